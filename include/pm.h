@@ -17,6 +17,13 @@ typedef unsigned long ulong;
  */
 typedef float (*conduction)(int, float);
 
+/*!
+ *   \brief Размер таблицы потоков lambda*c(|d|)*d
+ *          для d в [-255, 255]
+ */
+#define PM_LUT_SIZE   511
+#define PM_LUT_OFFSET 255 /*!< индекс d = 0 */
+
 typedef struct {
     /*!\{*/
     uint *bits; /*!< (упакованные rgba)    */
@@ -46,15 +53,58 @@ typedef struct {
     */
     float thresh;
     float lambda;   /*!< коэффициент Лапласиана (стабильный = 0.25f) */
+    /*!
+    * \brief Таблица потоков lambda*c(|d|)*d размером PM_LUT_SIZE
+    * \note если NULL, таблица строится при каждом вызове
+    * \see pm_lut_init
+    */
+    const float *lut;
+    /*!
+    * \brief Порог сходимости: обработка прекращается, когда
+    *        максимальное изменение канала за итерацию меньше epsilon
+    * \note 0 - выполнить все итерации
+    */
+    float epsilon;
+    /*!
+    * \brief Доля пересчитанных плиток на каждой итерации
+    *        (iterations элементов), заполняет pm()
+    * \note NULL - не сохранять
+    */
+    float *active;
 } proc_data; /*!< параметры обработки */
 
 /*!
  * \brief Последовательная реализация фильтра Перона-Малика
  * \note reference: https://people.eecs.berkeley.edu/~malik/papers/MP-aniso.pdf
+ * \note пересчитываются только плитки, которые или соседи которых
+ *       изменились; обработка завершается, когда изменений нет
+ * \return кол-во выполненных итераций, -1 - недостаточно памяти
  * \see img_data
  * \see proc_data
 */
-void pm(img_data *idata, proc_data *pdata);
+int pm(img_data *idata, proc_data *pdata);
+
+/*!
+ * \brief Строка одной итерации pm() на месте (обход как в pm(): слева
+ *        и сверху - новые значения, справа и снизу - старые)
+ * \param up - строка выше, уже пересчитанная на этой итерации
+ * \param row - строка предыдущей итерации, пересчитывается на месте
+ * \param down - строка ниже, предыдущая итерация
+ * \param w - ширина строк; крайние пиксели не изменяются
+ * \return максимальное изменение канала
+ */
+int pm_row(const uint *up, uint *row, const uint *down, int w, const float *lut);
+
+/*!
+ * \brief Одна итерация фильтра для строк [y0, y1): src -> dst
+ *        (без обновления на месте, строки можно считать параллельно)
+ * \param dst - изображение размером src
+ * \param lut - таблица потоков
+ * \note граница изображения копируется без изменений, результат
+ *       совпадает с ядром OpenCL
+ * \return максимальное изменение канала
+ */
+int pm_rows(const img_data *src, uint *dst, const float *lut, int y0, int y1);
 
 /*!
  * \brief Функции для вычисления коэффициента проводимости
@@ -65,5 +115,12 @@ float pm_quadric(int norm, float thresh);
 float pm_exponential(int norm, float thresh);
 /*!\}*/
 
+/*!
+ * \brief Заполнить таблицу потоков lambda*c(|d|)*d, d в [-255, 255]
+ * \param lut - массив размером PM_LUT_SIZE
+ * \note используются conduction_func, thresh и lambda
+ */
+void pm_lut_init(float *lut, const proc_data *pdata);
+
 
 #endif  /* __pm_h__ */
\ No newline at end of file
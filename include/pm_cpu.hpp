@@ -0,0 +1,71 @@
+/*!
+  \file
+  \brief Многопоточная реализация фильтра Перона-Малика на CPU
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __pm_cpu_hpp__
+#define __pm_cpu_hpp__
+
+extern "C" {
+#include "pm.h" // img_data, proc_data
+}
+
+#include "thread_pool.hpp" // ThreadPool
+
+typedef struct {
+    /*!\{*/
+    ThreadPool *pool; ///< пул потоков (используется повторно между вызовами)
+    int isa;          ///< набор инструкций (PM_ISA_*)
+    int tile_w;       ///< ширина плитки временного блокирования (0 - выкл.)
+    int tile_h;       ///< высота плитки временного блокирования
+    int tile_iterations; ///< кол-во итераций на плитку за один проход
+    bool profile;     ///< оценка трафика памяти
+    bool verbose;     ///< подробный вывод
+    /*!\}*/
+} cpu_data;  /*! параметры CPU */
+
+/*!
+ * Многопоточное выполнение фильтра Перона-Малика на float-плоскостях.
+ * Изображение делится на горизонтальные полосы по числу потоков пула,
+ * соседние полосы синхронизируются один раз за итерацию.
+ * При tile_w > 0 используется временное блокирование: плитки с ореолом
+ * tile_iterations продвигаются на tile_iterations итераций в кэше.
+ * Результат не зависит от количества потоков и размера плиток.
+ * Итерации прекращаются, когда максимальное изменение канала
+ * меньше pdata->epsilon (при блокировании - проверка раз в проход).
+ *
+ * \param idata - данные изображения
+ * \param pdata - параметры фильтра
+ * \param cdata - параметры CPU
+ * \return кол-во выполненных итераций
+ * \throws std::runtime_error
+ * \see img_data
+ * \see proc_data
+ * \see cpu_data
+ *
+ * ПРИМЕР:
+ * \code{cpp}
+
+  ThreadPool pool(threads);   // 0 - по числу ядер
+  cpu_data cdata = {
+      &pool,                  // пул потоков
+      pm_simd_detect(),       // набор инструкций
+      512, 64,                // размер плитки (0 - без блокирования)
+      8,                      // итераций на плитку
+      false,                  // оценить трафик памяти?
+      true                    // выводить детализированную информацию?
+  };
+
+  try
+  {
+    pm_cpu(&idata, &pdata, &cdata);
+  } catch(std::runtime_error e) {
+      std::cerr << e.what();
+  }
+ * \endcode
+ */
+int pm_cpu(img_data *idata, proc_data *pdata, cpu_data *cdata);
+
+#endif  /* __pm_cpu_hpp__ */
@@ -0,0 +1,35 @@
+/*!
+  \file
+  \brief Совместное выполнение фильтра Перона-Малика на CPU и устройстве OpenCL
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __pm_hetero_hpp__
+#define __pm_hetero_hpp__
+
+#include "pm_ocl.hpp"      // cl_data, PMSession
+#include "thread_pool.hpp" // ThreadPool
+
+/*!
+ * Совместное выполнение фильтра Перона-Малика на устройстве OpenCL и CPU.
+ * Верхняя полоса изображения [0, split) обрабатывается устройством,
+ * нижняя [split, h) - потоками пула (pm_rows), поток 0 управляет устройством.
+ * После каждой итерации полосы обмениваются граничной строкой через хост.
+ * Каждые несколько итераций граница split сдвигается к равному времени
+ * итерации обеих сторон (по измеренной скорости в строках в секунду),
+ * перешедшие строки передаются между хостом и устройством.
+ * Результат совпадает с pm_parallel.
+ *
+ * \param idata - данные изображения
+ * \param pdata - параметры фильтра
+ * \param cdata - параметры opencl (cdata.specialize не больше 1)
+ * \param pool - пул потоков (не меньше 2 потоков, иначе только устройство)
+ * \return кол-во выполненных итераций
+ * \throws cl::Error
+ * \throws std::runtime_error
+ * \see pm_rows
+ */
+int pm_hetero(img_data *idata, proc_data *pdata, cl_data *cdata, ThreadPool *pool);
+
+#endif  /* __pm_hetero_hpp__ */
@@ -13,24 +13,259 @@ extern "C" {
 }
 
 #include <string>
+#include <map>
+#include <vector>
+#include <functional>
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+    #define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if defined(__APPLE__) || defined(__MACOSX)
+    #include "cl.hpp"
+#else
+    #include <CL/cl.hpp>
+#endif
 
 typedef struct {
     /*!\{*/
     int platformId; ///< индекс платформы
     int deviceId;   ///< индекс устройства
     bool profile;   ///< включить профилирование?
-    std::string filename; ///< имя файла (kernel или биткод)
-    bool bitcode;   ///< filename указывает на биткод?
+    std::string filename; ///< имя файла (kernel или бинарная программа)
+    bool bitcode;   ///< filename указывает на бинарную программу?
     bool verbose;   ///< подробный вывод
+    std::string cache_dir; ///< каталог кэша бинарных программ и настройки (пусто - без кэша)
+    int specialize; ///< специализация программы: 0 - нет, 1 - параметры фильтра, 2 - и размер изображения
+    size_t tile_pixels; ///< предел тайла с ореолом при обработке по частям (0 - по памяти устройства)
     /*!\}*/
 } cl_data;  /*! параметры OpenCL */
 
 /*!
- * Параллельное выполнение фильтра Перона-Малика
+ * Сеанс OpenCL: платформа, устройство, контекст, очередь команд,
+ * собранная программа и ядро создаются один раз и используются
+ * для любого количества изображений.
+ * Собранная программа сохраняется в cdata.cache_dir (CL_PROGRAM_BINARIES)
+ * под хэшем платформы, устройства, версии драйвера, опций сборки и
+ * исходного кода; следующие запуски загружают её без компиляции.
+ * Там же хранится результат tune() для устройства.
+ * Буфер изображения пересоздаётся только при увеличении размера,
+ * таблица потоков загружается только при изменении параметров.
+ *
+ * ПРИМЕР:
+ * \code{cpp}
+
+  PMSession session(cdata);    // выбор устройства и сборка программы
+  for(auto &image : images) {
+      session.run(&image, &pdata);
+  }
+ * \endcode
+ */
+class PMSession
+{
+public:
+    /*!
+     * \throws cl::Error
+     * \throws std::runtime_error
+     * \throws std::invalid_argument
+     */
+    explicit PMSession(const cl_data &cdata);
+    /*!
+     * \brief Сеанс на заданном устройстве (cdata.platformId, cdata.deviceId не используются)
+     */
+    PMSession(const cl_data &cdata, const cl::Device &device);
+    PMSession(const PMSession &) = delete;
+    PMSession &operator=(const PMSession &) = delete;
+public:
+    /*!
+     * \brief Обработать изображение (результат записывается в idata->bits);
+     *        изображение, которое не помещается на устройство, - по частям
+     * \return кол-во выполненных итераций
+     * \throws cl::Error
+     * \throws std::runtime_error
+     */
+    int run(img_data *idata, proc_data *pdata);
+    /*!
+     * \brief Обработать изображение RGB24 (байты P6: r g b подряд, w * h пикселей);
+     *        упаковка в 0x00RRGGBB и обратно выполняется на устройстве
+     *        (pm_unpack, pm_pack), результат записывается в dst
+     *        (может совпадать с src, если src доступен для записи; dst -
+     *        например MappedPPM::writablePixels() файла, созданного create());
+     *        если буферы не помещаются на устройство или пикселей больше
+     *        INT_MAX - упаковка на хосте и run()
+     * \return кол-во выполненных итераций
+     * \throws cl::Error
+     * \throws std::runtime_error
+     */
+    int runRGB(const unsigned char *src, unsigned char *dst, int w, int h, proc_data *pdata);
+    /*!
+     * \brief Конвейерная обработка серии изображений: три очереди команд
+     *        (загрузка, вычисление, выгрузка), связанные событиями.
+     *        Изображение N+1 загружается, пока N обрабатывается, а N-1
+     *        выгружается; передачи идут через закреплённые (pinned) буферы
+     *        хоста из пула, которые используются повторно.
+     * \param load - следующее изображение серии (false - серия закончилась),
+     *        idata.bits действителен до следующего вызова load
+     * \param store - результат изображения с порядковым номером index
+     *        (в порядке загрузки), idata.bits действителен только во время вызова
+     * \return кол-во обработанных изображений
+     * \note используются буферы (без image2d_t)
+     * \throws cl::Error
+     * \throws std::runtime_error
+     */
+    int pipeline(proc_data *pdata, const std::function<bool(img_data &)> &load,
+                 const std::function<void(int, const img_data &)> &store);
+    /*!
+     * \brief Подобрать вариант ядра и размер рабочей группы: замер всех
+     *        допустимых сочетаний на изображении idata, победитель
+     *        используется сеансом и сохраняется в файл настройки устройства
+     *        (каталог cdata.cache_dir), который загружается при создании сеанса
+     * \throws cl::Error
+     * \throws std::runtime_error
+     */
+    void tune(img_data *idata, proc_data *pdata);
+    /*!
+     * \brief Время итерации на изображении idata (нс), для распределения работы
+     * \throws cl::Error
+     */
+    double measure(const img_data *idata, proc_data *pdata);
+    /*!
+     * \name Пошаговая обработка (полоса изображения с ореолом)
+     * \{
+     */
+    /*!
+     * \brief Загрузить изображение; вариант для буферов, без image2d_t
+     */
+    void begin(const img_data *idata, proc_data *pdata);
+    /*!
+     * \brief Итераций за запуск выбранного варианта (глубина ореола полосы)
+     */
+    int stepsPerLaunch() const;
+    /*!
+     * \brief Поставить в очередь n итераций (без ожидания)
+     * \param converge - измерять изменение последнего запуска (lastChange)
+     */
+    void iterate(int n, bool converge);
+    /*!
+     * \brief Строки [y, y + rows) текущего изображения: чтение без ожидания
+     *        (до wait()), запись с ожиданием
+     */
+    void readRows(int y, int rows, uint *dst);
+    void writeRows(int y, int rows, const uint *src);
+    /*!
+     * \brief Обрабатывать только строки [0, rows) загруженного изображения,
+     *        строка rows - 1 не изменяется (граница полосы)
+     * \note несовместимо со специализацией программы по размеру изображения
+     */
+    void setRows(int rows);
+    /*!
+     * \brief Учитывать в lastChange() только строки [y0, y1) загруженного
+     *        изображения: ореол полосы после нескольких шагов pm_temporal
+     *        неточен (у ядер в один шаг ореол - неизменяемая граница)
+     */
+    void setChangeRows(int y0, int y1);
+    /*!
+     * \brief Дождаться выполнения очереди
+     */
+    void wait();
+    /*!
+     * \brief Максимальное изменение канала за последний запуск iterate()
+     */
+    cl_uint lastChange();
+    /*! \} */
+    const cl::Device &getDevice() const;
+private:
+    /*!
+     * \brief Вариант ядра и параметры его запуска
+     */
+    struct Variant {
+        cl::Kernel kernel;
+        size_t local_x;     ///< размер рабочей группы
+        size_t local_y;
+        size_t local_bytes; ///< локальная память группы (0 - не используется)
+        int steps;          ///< итераций за запуск (pm_temporal), иначе 1
+        int width;          ///< пикселей на рабочий элемент (pm_vec), иначе 1
+        bool image;         ///< image2d_t вместо буферов (pm_image)
+    };
+    /*!
+     * \brief Программа, собранная с определёнными опциями, и её варианты ядра
+     */
+    struct Build {
+        cl::Program program;
+        Variant variant;
+        Variant image_variant;
+        bool use_image;
+    };
+private:
+    void selectDevice();
+    void buildProgram(const std::string &options);
+    std::string specialization(const img_data *idata) const;
+    void specialize(const img_data *idata);
+    void buildFromSource(const std::string &source, const std::string &options);
+    unsigned long long deviceHash() const;
+    std::string cachePath(const std::string &source, const std::string &options) const;
+    std::string tunePath() const;
+    bool loadTuning();
+    bool makeVariant(const std::string &name, size_t lx, size_t ly, int steps, Variant &v) const;
+    std::vector<Variant> candidates(const img_data *idata) const;
+    void upload(const img_data *idata, bool image);
+    void prepare(const Variant &v, const img_data *idata, size_t &global_x, size_t &global_y);
+    double variantTime(const Variant &v, const img_data *idata, int iterations);
+    void reserve(size_t pixels);
+    void reserveImages(int w, int h);
+    bool imageFits(int w, int h) const;
+    void uploadLut(const proc_data *pdata);
+    void localSize(const cl::Kernel &k, size_t &lx, size_t &ly) const;
+    void selectKernel();
+    int vectorWidth() const;
+    double singleStepTime(const img_data *idata, int iterations);
+    bool fitsDevice(size_t pixels) const;
+    int runOutOfCore(img_data *idata, proc_data *pdata);
+    int filter(bool image, const img_data *idata, proc_data *pdata, int &src,
+               std::vector<cl::Event> &events);
+    void report(const Variant &v, const img_data *idata, const std::vector<cl::Event> &events, int it);
+private:
+    cl_data cdata;
+    cl::Platform platform;
+    cl::Device device;
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Program program;
+    Variant variant;               ///< ядро для буферов (pm, pm_local, pm_temporal)
+    Variant image_variant;         ///< ядро для image2d_t (pm_image)
+    bool use_image;                ///< pm_image, если изображение помещается в image2d_t
+    int vec_width;                 ///< PM_VEC_WIDTH программы (pm_vec)
+    std::string build_options;     ///< опции сборки текущей программы
+    std::map<std::string, Build> builds; ///< собранные программы по опциям сборки
+    bool image_support;            ///< CL_DEVICE_IMAGE_SUPPORT
+    cl::Buffer bits[2];            ///< изображение: источник и приёмник итерации
+    size_t bits_capacity;          ///< размер буферов bits в пикселях
+    cl::Image2D images[2];         ///< изображение для pm_image
+    int image_w;                   ///< размер images
+    int image_h;
+    cl::Buffer lut;                ///< таблица потоков (__constant)
+    float lut_host[PM_LUT_SIZE];   ///< загруженная в lut таблица
+    bool lut_valid;
+    cl::Buffer change;             ///< максимальное изменение канала за итерацию
+    int step_w;                    ///< пошаговая обработка: ширина изображения
+    int step_src;                  ///< буфер bits с результатом последней итерации
+    size_t step_global_x;          ///< глобальный размер
+    size_t step_global_y;
+    cl::Buffer rgb_bytes;          ///< изображение RGB24 для runRGB
+    size_t rgb_capacity;           ///< размер rgb_bytes в байтах
+};
+
+/*!
+ * Параллельное выполнение фильтра Перона-Малика.
+ * Итерации выполняются, пока максимальное изменение канала
+ * за итерацию не станет меньше pdata->epsilon.
+ * \note создаёт PMSession на один вызов; для серии изображений
+ *       используйте PMSession напрямую
  *
  * \param idata - данные изображения
  * \param pdata - параметры фильтра
  * \param cdata - параметры opencl
+ * \return кол-во выполненных итераций
  * \throws cl::Error
  * \throws std::runtime_error
  * \throws std::invalid_argument
@@ -53,16 +288,22 @@ typedef struct {
       conduction_function,  // функция для вычисления проводимости [0, 1]
       NULL,                 // не используется
       thresh,               // пороговое значение
-      lambda                // коэффициент Лапласиана
+      lambda,               // коэффициент Лапласиана
+      NULL,                 // таблица потоков (строится автоматически)
+      0.0f,                 // порог сходимости (0 - все итерации)
+      NULL                  // доля активных плиток (только pm())
   };
   // Настройка OpenCL
   cl_data cdata = {
       platformId,           // номер платформы
       deviceId,             // номер устройства
       false,                // профилировать?
-      kernel_file,          // файл с кодом ядра / биткодом
-      false,                // биткод?
-      true                  // выводить детализированную информацию?
+      kernel_file,          // файл с кодом ядра / бинарной программой
+      false,                // бинарная программа?
+      true,                 // выводить детализированную информацию?
+      "pm_cache",           // каталог кэша бинарных программ и настройки
+      0,                    // специализация программы (-D) по параметрам
+      0                     // предел тайла (0 - по памяти устройства)
   };
 
   try
@@ -77,6 +318,47 @@ typedef struct {
   }
  * \endcode
  */
-void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata);
+int pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata);
+
+/*!
+ * Параллельное выполнение фильтра Перона-Малика на нескольких устройствах.
+ * Изображение делится на горизонтальные полосы, высота полосы пропорциональна
+ * измеренной производительности устройства; у каждого устройства свой сеанс
+ * (очередь и буферы). Соседние полосы обмениваются ореолом через хост:
+ * по одной строке после каждой итерации (k строк после k итераций, если
+ * все устройства используют pm_temporal). Сходимость (pdata->epsilon)
+ * проверяется по собственным строкам полос, без ореола, поэтому результат
+ * и кол-во итераций совпадают с pm_parallel при том же числе итераций
+ * за запуск.
+ *
+ * \param idata - данные изображения
+ * \param pdata - параметры фильтра
+ * \param cdata - параметры opencl (cdata.deviceId не используется)
+ * \param devices - индексы устройств платформы cdata.platformId (пусто - все)
+ * \return кол-во выполненных итераций
+ * \throws cl::Error
+ * \throws std::runtime_error
+ * \throws std::invalid_argument
+ */
+int pm_multi(img_data *idata, proc_data *pdata, cl_data *cdata, const std::vector<int> &devices);
+
+/*!
+ * Параллельное выполнение фильтра Перона-Малика над изображением RGB24
+ * (байты P6) без упаковки на хосте: байты загружаются на устройство
+ * и распаковываются ядром pm_unpack, результат упаковывается ядром pm_pack.
+ * Загрузка на 25% меньше, чем у упакованных пикселей.
+ *
+ * \param src - 3 * w * h байт исходного изображения
+ * \param dst - 3 * w * h байт результата (может совпадать с src, доступным для записи)
+ * \param w, h - размер изображения в px
+ * \param pdata - параметры фильтра
+ * \param cdata - параметры opencl
+ * \return кол-во выполненных итераций
+ * \throws cl::Error
+ * \throws std::runtime_error
+ * \throws std::invalid_argument
+ */
+int pm_parallel_rgb(const unsigned char *src, unsigned char *dst, int w, int h,
+                    proc_data *pdata, cl_data *cdata);
 
 #endif  /* __pm_ocl_hpp__ */
\ No newline at end of file
@@ -0,0 +1,68 @@
+/*!
+  \file
+  \brief Конвейер итераций фильтра Перона-Малика над потоком строк
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __pm_pipeline_hpp__
+#define __pm_pipeline_hpp__
+
+extern "C" {
+#include "pm.h" // proc_data, uint
+}
+
+#include <functional>
+
+/*!
+ * \brief Источник строк: заполнить следующую строку (w упакованных пикселей)
+ */
+typedef std::function<void(uint *row)> row_reader;
+/*!
+ * \brief Приёмник строк: очередная готовая строка (w упакованных пикселей)
+ */
+typedef std::function<void(const uint *row)> row_writer;
+
+/*!
+ * Конвейерное выполнение фильтра Перона-Малика над потоком строк.
+ * Поток-стадия применяет свой блок итераций к строкам сразу, как только
+ * предыдущая стадия выдала строки, нужные для пересчёта (строка y
+ * итерации k готова после строки y+1 итерации k-1). Стадии передают строки
+ * через кольцевые буферы без блокировок (один производитель, один
+ * потребитель). Чтение (read) и запись (write) выполняются отдельными
+ * потоками. Каждая стадия хранит три строки, изображение целиком
+ * в памяти не находится.
+ * Результат совпадает с pm() побитово.
+ * \note выполняются все итерации, порог сходимости не используется,
+ *       pdata->active не заполняется
+ *
+ * \param w - ширина изображения
+ * \param h - высота изображения
+ * \param read - вызывается h раз, строки сверху вниз
+ * \param write - вызывается h раз, строки сверху вниз
+ * \param pdata - параметры фильтра
+ * \param stages - кол-во стадий (0 - по числу ядер), не больше кол-ва итераций
+ * \param verbose - подробный вывод
+ * \return кол-во выполненных итераций
+ * \throws исключения read и write передаются вызывающему
+ * \see pm_row
+ *
+ * ПРИМЕР:
+ * \code{cpp}
+
+  PPMReader reader;
+  reader.open(src);
+  std::vector<unsigned char> rgb(reader.width * 3);
+
+  pm_pipeline(reader.width, reader.height, [&](uint *row) {
+      reader.readRows(rgb.data(), 1);
+      pack(rgb.data(), row, reader.width);
+  }, [&](const uint *row) {
+      store(row);
+  }, &pdata, 0, false);
+ * \endcode
+ */
+int pm_pipeline(int w, int h, const row_reader &read, const row_writer &write,
+                proc_data *pdata, int stages, bool verbose);
+
+#endif  /* __pm_pipeline_hpp__ */
@@ -0,0 +1,80 @@
+/*!
+  \file
+  \brief Итерации фильтра Перона-Малика на раздельных float-плоскостях
+         с двойной буферизацией (основа pm_cpu)
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __pm_planar_h__
+#define __pm_planar_h__
+
+#include "pm.h"      /* img_data, proc_data */
+#include "pm_simd.h" /* pm_row_func */
+
+#define PM_PLANES 3 /*!< кол-во плоскостей (r, g, b) */
+
+typedef struct {
+    /*!\{*/
+    float *buf[2];  /*!< буферы источник / приёмник (по PM_PLANES плоскостей w*h) */
+    int src;        /*!< индекс буфера-источника текущей итерации */
+    int w;          /*!< ширина */
+    int h;          /*!< высота */
+    float coef[PM_COEF_SIZE]; /*!< таблица lambda*c(|d|) */
+    pm_row_func row;          /*!< обработка строки (scalar / SIMD) */
+    /*!\}*/
+} planar_data; /*!< изображение в виде раздельных float-плоскостей */
+
+/*!
+ * \brief Выделить буферы плоскостей
+ * \return 0 - успех, -1 - недостаточно памяти
+ */
+int pm_planar_alloc(planar_data *pd, int w, int h);
+/*!
+ * \brief Освободить буферы плоскостей
+ */
+void pm_planar_free(planar_data *pd);
+/*!
+ * \brief Распаковать rgb из idata->bits в оба буфера
+ * \note граничные пиксели не изменяются фильтром,
+ *       поэтому они должны совпадать в обоих буферах
+ */
+void pm_planar_unpack(planar_data *pd, const img_data *idata);
+/*!
+ * \brief Упаковать текущий буфер-источник в idata->bits
+ */
+void pm_planar_pack(const planar_data *pd, img_data *idata);
+/*!
+ * \brief Указатель на плоскость ch буфера buf
+ */
+float *pm_planar_plane(const planar_data *pd, int buf, int ch);
+/*!
+ * \brief Заполнить таблицу lambda*c(|d|), |d| в [0, 255]
+ * \param coef - массив размером PM_COEF_SIZE
+ */
+void pm_coef_init(float *coef, const proc_data *pdata);
+/*!
+ * \brief Подготовить таблицу проводимости и выбрать реализацию строки
+ * \param isa - набор инструкций (PM_ISA_*)
+ * \see pm_simd_detect
+ */
+void pm_planar_setup(planar_data *pd, const proc_data *pdata, int isa);
+/*!
+ * \brief Одна итерация фильтра для прямоугольника [x0, x1) x [y0, y1)
+ *        из источника в приёмник
+ * \note граничные строки и столбцы не обрабатываются
+ * \return максимальное изменение канала
+ */
+float pm_planar_rect(planar_data *pd, int x0, int y0, int x1, int y1);
+/*!
+ * \brief Одна итерация фильтра для строк [y0, y1) из источника в приёмник
+ * \note граничные строки и столбцы не обрабатываются
+ * \return максимальное изменение канала
+ */
+float pm_planar_rows(planar_data *pd, int y0, int y1);
+/*!
+ * \brief Поменять местами источник и приёмник
+ */
+void pm_planar_swap(planar_data *pd);
+
+#endif  /* __pm_planar_h__ */
@@ -0,0 +1,62 @@
+/*!
+  \file
+  \brief Векторные (SIMD) реализации строки фильтра Перона-Малика
+         с выбором набора инструкций по CPUID
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __pm_simd_h__
+#define __pm_simd_h__
+
+/*!
+ * \brief Наборы инструкций
+ * \{
+ */
+#define PM_ISA_SCALAR 0
+#define PM_ISA_SSE41  1
+#define PM_ISA_AVX2   2
+#define PM_ISA_AVX512 3
+/*!\}*/
+
+#define PM_COEF_SIZE 256 /*!< таблица lambda*c(|d|), |d| в [0, 255] */
+
+/*!
+ * \brief Указатель на функцию обработки строки одного канала
+ * \param n, c, s - строки источника y-1, y, y+1
+ * \param out - строка приёмника y
+ * \param x0, x1 - обрабатываемые столбцы [x0, x1)
+ * \param coef - таблица lambda*c(|d|) размером PM_COEF_SIZE,
+ *               индекс - |d|, округлённый к ближайшему
+ * \return максимальное |out[x] - c[x]| (0, если x0 >= x1)
+ */
+typedef float (*pm_row_func)(const float *n, const float *c, const float *s,
+                             float *out, int x0, int x1, const float *coef);
+
+/*!
+ * \brief Лучший набор инструкций, поддерживаемый процессором и ОС
+ * \note результат определяется один раз и учитывает pm_simd_limit
+ */
+int pm_simd_detect(void);
+/*!
+ * \brief Ограничить набор инструкций сверху (PM_ISA_*)
+ */
+void pm_simd_limit(int isa);
+/*!
+ * \brief Название набора инструкций
+ */
+const char *pm_simd_name(int isa);
+/*!
+ * \brief Функция обработки строки для набора инструкций
+ * \note все варианты дают побитово одинаковый результат
+ */
+pm_row_func pm_simd_row(int isa);
+
+/*!
+ * \brief Скалярная реализация строки
+ * \see pm_row_func
+ */
+float pm_row_scalar(const float *n, const float *c, const float *s,
+                    float *out, int x0, int x1, const float *coef);
+
+#endif  /* __pm_simd_h__ */
@@ -10,6 +10,7 @@
 
 #include <vector>
 #include <string>
+#include <fstream>
 
 class PPMImage
 {
@@ -35,4 +36,107 @@ public:
     int width, height;
 };
 
+/*!
+ * Изображение P6, отображённое в память (mmap): пиксели читаются из
+ * файла и пишутся в файл без промежуточных копий.
+ * Без mmap (Windows) файл читается в буфер и записывается при close().
+ *
+ * ПРИМЕР:
+ * \code{cpp}
+
+  MappedPPM in, out;
+  in.open("in.ppm");                        // байты пикселей - в отображении
+  out.create("out.ppm", in.width, in.height);
+  process(in.pixels(), out.writablePixels(), in.width, in.height);
+  out.close();
+ * \endcode
+ */
+class MappedPPM
+{
+public:
+    MappedPPM();
+    ~MappedPPM();
+    MappedPPM(const MappedPPM &) = delete;
+    MappedPPM &operator=(const MappedPPM &) = delete;
+public:
+    /*!
+     * \brief Отобразить файл только для чтения
+     * \throws std::invalid_argument
+     */
+    void open(const std::string &path);
+    /*!
+     * \brief Создать файл w x h (заголовок записан, размер - ftruncate)
+     *        и отобразить для записи
+     * \throws std::invalid_argument
+     */
+    void create(const std::string &path, int w, int h);
+    /*!
+     * \brief Снять отображение и закрыть файл
+     */
+    void close();
+    /*!
+     * \brief Байты пикселей (r g b подряд)
+     */
+    const unsigned char *pixels() const;
+    /*!
+     * \brief Байты пикселей для записи: только после create(),
+     *        отображение open() - PROT_READ
+     * \throws std::invalid_argument - отображение только для чтения
+     */
+    unsigned char *writablePixels();
+public:
+    int width, height;
+private:
+    char *data;         ///< отображение файла
+    size_t length;      ///< размер файла
+    size_t payload;     ///< смещение байтов пикселей
+    int fd;             ///< дескриптор файла (-1 - закрыт)
+    bool writable;
+    std::string path;           ///< без mmap: файл для записи при close()
+    std::vector<char> buffer;   ///< без mmap: содержимое файла
+};
+
+/*!
+ * Построчное чтение P6: заголовок - при open(), строки пикселей - по запросу,
+ * в памяти находятся только запрошенные строки
+ */
+class PPMReader
+{
+public:
+    /*!
+     * \throws std::invalid_argument
+     */
+    void open(const std::string &path);
+    /*!
+     * \brief Следующие rows строк (r g b подряд, rows * width * 3 байт)
+     * \throws std::invalid_argument - файл короче заголовка
+     */
+    void readRows(unsigned char *dst, int rows);
+public:
+    int width, height;
+private:
+    std::ifstream in;
+};
+
+/*!
+ * Построчная запись P6: заголовок - при create(), строки - по мере готовности
+ */
+class PPMWriter
+{
+public:
+    /*!
+     * \throws std::invalid_argument
+     */
+    void create(const std::string &path, int w, int h);
+    /*!
+     * \throws std::invalid_argument
+     */
+    void writeRows(const unsigned char *src, int rows);
+    void close();
+public:
+    int width, height;
+private:
+    std::ofstream out;
+};
+
 #endif // __PPM_IMAGE__
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*!
+  \file
+  \brief Пул потоков с барьерной синхронизацией
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#ifndef __thread_pool_hpp__
+#define __thread_pool_hpp__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*!
+ * Постоянный пул потоков. Потоки создаются один раз и
+ * используются повторно для любого количества задач.
+ *
+ * ПРИМЕР:
+ * \code{cpp}
+
+  ThreadPool pool(4);
+  pool.run([&](int idx) {
+      for(int it = 0; it < iterations; ++it) {
+          process(band(idx));
+          pool.barrier();   // дождаться соседних полос
+      }
+  });
+ * \endcode
+ */
+class ThreadPool
+{
+public:
+    /*!
+     * \param threads - кол-во потоков (0 - по числу ядер)
+     */
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+public:
+    /*!
+     * \brief Выполнить task(idx) во всех потоках пула, idx в [0, size())
+     * \note вызывающий поток выполняет task(0); возврат после завершения всех
+     */
+    void run(const std::function<void(int)> &task);
+    /*!
+     * \brief Барьер: ожидание всех потоков пула внутри run()
+     */
+    void barrier();
+    int size() const;
+private:
+    void worker(int idx);
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv;   ///< новая задача / остановка
+    std::condition_variable done_cv;    ///< задача выполнена всеми потоками
+    std::condition_variable barrier_cv; ///< все потоки достигли барьера
+    const std::function<void(int)> *task;
+    unsigned long generation;           ///< номер текущей задачи
+    int pending;                        ///< потоки, не завершившие задачу
+    int barrier_count;                  ///< потоки, ожидающие на барьере
+    unsigned long barrier_generation;   ///< номер текущего барьера
+    bool stop;
+};
+
+#endif  /* __thread_pool_hpp__ */
@@ -23,52 +23,492 @@ int getChannel(uint rgb, int channel)
     return 0;
 }
 
-float quadric(int norm, float thresh)
+#define PM_LUT_OFFSET 255 /* индекс d = 0 в таблице потоков */
+
+/*
+ * Специализация программы опциями сборки: значения, известные при сборке,
+ * заменяют аргументы ядра, и компилятор сворачивает их как константы
+ *   -D PM_LUT=<511 значений> - таблица потоков (функция, порог, lambda)
+ *   -D PM_WIDTH=<w> -D PM_HEIGHT=<h> - размер изображения
+ */
+#ifdef PM_LUT
+__constant float pm_lut[2 * PM_LUT_OFFSET + 1] = { PM_LUT };
+#define PM_SPECIALIZE_LUT(lut) (lut) = pm_lut
+#else
+#define PM_SPECIALIZE_LUT(lut) (void)0
+#endif
+
+#if defined(PM_WIDTH) && defined(PM_HEIGHT)
+#define PM_SPECIALIZE_SIZE(w, h) (w) = PM_WIDTH; (h) = PM_HEIGHT
+#else
+#define PM_SPECIALIZE_SIZE(w, h) (void)0
+#endif
+
+#define PM_SPECIALIZE(lut, w, h) PM_SPECIALIZE_LUT(lut); PM_SPECIALIZE_SIZE(w, h)
+
+/*!
+ * \brief Одна итерация фильтра: src -> dst (буферы меняются местами на хосте)
+ * \note граница изображения копируется без изменений
+ * \param lut - таблица потоков lambda*c(|d|)*d, d в [-255, 255]
+ * \param change - максимальное изменение канала за итерацию (atomic_max)
+ */
+__kernel void pm(__global const uint *src,
+                 __global uint *dst,
+                 __constant float *lut,
+                 __global uint *change,
+                 int w,
+                 int h)
 {
-    return 1.0f / (1.0f + norm * norm / (thresh * thresh));
+    PM_SPECIALIZE(lut, w, h);
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    /* глобальный размер дополнен до кратного размеру группы */
+    if(x >= w || y >= h) {
+        return;
+    }
+
+    if(x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+        dst[x + y * w] = src[x + y * w];
+        return;
+    }
+
+    int p, deltaW, deltaE, deltaS, deltaN;
+    int rgb[3] = {0};
+    uint d = 0;
+    for(int ch = 0; ch < 3; ++ch) {
+        p = getChannel(src[x + y * w], ch);
+        deltaW = getChannel(src[x + (y-1) * w], ch) - p;
+        deltaE = getChannel(src[x + (y+1) * w], ch) - p;
+        deltaS = getChannel(src[x+1 + y * w],   ch) - p;
+        deltaN = getChannel(src[x-1 + y * w],   ch) - p;
+        rgb[ch] = (int)(p + (lut[deltaN + PM_LUT_OFFSET] + lut[deltaS + PM_LUT_OFFSET] +
+                             lut[deltaE + PM_LUT_OFFSET] + lut[deltaW + PM_LUT_OFFSET]));
+        d = max(d, (uint)abs((rgb[ch] & 0xff) - p));  /* записанное значение канала */
+    }
+    dst[x + y * w] = PM_RGB(rgb[0], rgb[1], rgb[2]);
+
+    /* атомарная операция только если максимум может вырасти */
+    if(d > *change) {
+        atomic_max(change, d);
+    }
 }
 
-float exponential(int norm, float thresh)
+/*!
+ * \brief Распаковать rgb в вектор каналов (r, g, b, 0)
+ */
+uchar4 unpack(uint rgb)
 {
-    return exp(- norm * norm / (thresh * thresh));
+    return (uchar4)(PM_RED(rgb), PM_GREEN(rgb), PM_BLUE(rgb), 0);
 }
 
-__kernel void pm(__global uint *bits,
-                 float thresh,
-                 int  eval_func,
-                 float lambda,
-                 int w,
-                 int h,
-                 int offsetX,
-                 int offsetY)
+/*!
+ * \brief Потоки для трёх каналов
+ */
+float4 flux(int4 d, __constant float *lut)
+{
+    return (float4)(lut[d.x + PM_LUT_OFFSET], lut[d.y + PM_LUT_OFFSET],
+                    lut[d.z + PM_LUT_OFFSET], 0.0f);
+}
+
+/*!
+ * \brief Одна итерация фильтра через локальную память: группа загружает
+ *        свою плитку с ореолом в 1 px и распаковывает её один раз,
+ *        каждый пиксель читается из глобальной памяти ~1 раз вместо 5
+ * \note результат совпадает с pm
+ * \param tile - (get_local_size(0) + 2) x (get_local_size(1) + 2) пикселей
+ */
+__kernel void pm_local(__global const uint *src,
+                       __global uint *dst,
+                       __constant float *lut,
+                       __global uint *change,
+                       int w,
+                       int h,
+                       __local uchar4 *tile)
+{
+    PM_SPECIALIZE(lut, w, h);
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int tw = get_local_size(0) + 2, th = get_local_size(1) + 2;
+    const int x0 = get_group_id(0) * get_local_size(0) - 1;
+    const int y0 = get_group_id(1) * get_local_size(1) - 1;
+
+    /* совместная загрузка плитки с ореолом, координаты прижаты к изображению */
+    for(int i = lx + ly * get_local_size(0); i < tw * th;
+        i += get_local_size(0) * get_local_size(1)) {
+        const int gx = clamp(x0 + i % tw, 0, w - 1);
+        const int gy = clamp(y0 + i / tw, 0, h - 1);
+        tile[i] = unpack(src[gx + gy * w]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if(x >= w || y >= h) {
+        return;
+    }
+
+    if(x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+        dst[x + y * w] = src[x + y * w];
+        return;
+    }
+
+    const int c = (lx + 1) + (ly + 1) * tw;
+    const int4 p = convert_int4(tile[c]);
+    /* порядок суммы как в pm: x-1, x+1, y+1, y-1 */
+    float4 sum = flux(convert_int4(tile[c - 1]) - p, lut) +
+                 flux(convert_int4(tile[c + 1]) - p, lut);
+    sum = sum + flux(convert_int4(tile[c + tw]) - p, lut);
+    sum = sum + flux(convert_int4(tile[c - tw]) - p, lut);
+    const int4 rgb = convert_int4(convert_float4(p) + sum);
+    dst[x + y * w] = PM_RGB(rgb.x, rgb.y, rgb.z);
+
+    const uint4 d = abs((rgb & 0xff) - p);  /* записанное значение канала */
+    const uint m = max(max(d.x, d.y), d.z);
+
+    /* атомарная операция только если максимум может вырасти */
+    if(m > *change) {
+        atomic_max(change, m);
+    }
+}
+
+/*!
+ * \brief Несколько итераций фильтра за один запуск (временное блокирование):
+ *        группа загружает плитку с ореолом steps пикселей в локальную память
+ *        и продвигает её на steps итераций; на шаге s верна область плитки
+ *        без s крайних пикселей, в dst записывается только центр размером
+ *        с группу. Изображение читается из глобальной памяти ~iterations/steps раз.
+ * \note результат совпадает со steps запусками pm
+ * \param tile - 2 x (get_local_size(0) + 2*steps) x (get_local_size(1) + 2*steps)
+ *               пикселей (источник и приёмник шага)
+ * \param change_y0, change_y1 - в change учитываются строки [change_y0, change_y1)
+ *        (ореол полосы после нескольких шагов неточен)
+ */
+__kernel void pm_temporal(__global const uint *src,
+                          __global uint *dst,
+                          __constant float *lut,
+                          __global uint *change,
+                          int w,
+                          int h,
+                          int steps,
+                          __local uchar4 *tile,
+                          int change_y0,
+                          int change_y1)
 {
-    const int x = offsetX + get_global_id(0);
-    const int y = offsetY + get_global_id(1);
-
-    if(x < w && y < h) {
-        int p, deltaW, deltaE, deltaS, deltaN;
-        float cN, cS, cE, cW;
-        int rgb[3] = {0};
-        for(int ch = 0; ch < 3; ++ch) {
-            p = getChannel(bits[x + y * w], ch);
-            deltaW = getChannel(bits[x + (y-1) * w], ch) - p;
-            deltaE = getChannel(bits[x + (y+1) * w], ch) - p;
-            deltaS = getChannel(bits[x+1 + y * w],   ch) - p;
-            deltaN = getChannel(bits[x-1 + y * w],   ch) - p;
-            if(eval_func) {
-                cN = exponential(abs(deltaN), thresh);
-                cS = exponential(abs(deltaS), thresh);
-                cE = exponential(abs(deltaE), thresh);
-                cW = exponential(abs(deltaW), thresh);
-            } else {
-                cN = quadric(abs(deltaN), thresh);
-                cS = quadric(abs(deltaS), thresh);
-                cE = quadric(abs(deltaE), thresh);
-                cW = quadric(abs(deltaW), thresh);
+    PM_SPECIALIZE(lut, w, h);
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int lid = lx + ly * get_local_size(0);
+    const int lsize = get_local_size(0) * get_local_size(1);
+    const int tw = get_local_size(0) + 2 * steps, th = get_local_size(1) + 2 * steps;
+    const int x0 = get_group_id(0) * get_local_size(0) - steps;
+    const int y0 = get_group_id(1) * get_local_size(1) - steps;
+    __local uchar4 *in = tile;
+    __local uchar4 *out = tile + tw * th;
+
+    /* совместная загрузка плитки с ореолом, координаты прижаты к изображению */
+    for(int i = lid; i < tw * th; i += lsize) {
+        const int gx = clamp(x0 + i % tw, 0, w - 1);
+        const int gy = clamp(y0 + i / tw, 0, h - 1);
+        in[i] = unpack(src[gx + gy * w]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(int s = 1; s <= steps; ++s) {
+        for(int i = lid; i < tw * th; i += lsize) {
+            const int tx = i % tw, ty = i / tw;
+
+            if(tx < s || ty < s || tx >= tw - s || ty >= th - s) {
+                continue;
             }
-			rgb[ch] = (int)(p + lambda * (cN * deltaN + cS * deltaS +
-                                          cE * deltaE + cW * deltaW));
+
+            const int gx = x0 + tx, gy = y0 + ty;
+
+            /* граница изображения и область за ней не изменяются */
+            if(gx <= 0 || gy <= 0 || gx >= w - 1 || gy >= h - 1) {
+                out[i] = in[i];
+                continue;
+            }
+
+            const int4 p = convert_int4(in[i]);
+            /* порядок суммы как в pm: x-1, x+1, y+1, y-1 */
+            float4 sum = flux(convert_int4(in[i - 1]) - p, lut) +
+                         flux(convert_int4(in[i + 1]) - p, lut);
+            sum = sum + flux(convert_int4(in[i + tw]) - p, lut);
+            sum = sum + flux(convert_int4(in[i - tw]) - p, lut);
+            out[i] = convert_uchar4(convert_int4(convert_float4(p) + sum) & 0xff);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+        __local uchar4 *t = in;
+        in = out;
+        out = t;
+    }
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if(x >= w || y >= h) {
+        return;
+    }
+
+    /* центр плитки: результат последнего и предпоследнего шага */
+    const int c = (lx + steps) + (ly + steps) * tw;
+    const uchar4 v = in[c];
+    dst[x + y * w] = PM_RGB(v.x, v.y, v.z);
+
+    const uint4 d = abs(convert_int4(v) - convert_int4(out[c]));
+    const uint m = max(max(d.x, d.y), d.z);
+
+    /* атомарная операция только если максимум может вырасти */
+    if(y >= change_y0 && y < change_y1 && m > *change) {
+        atomic_max(change, m);
+    }
+}
+
+/*!
+ * \brief Сэмплер: целочисленные координаты, за краем - ближайший пиксель края
+ */
+__constant sampler_t clampSampler = CLK_NORMALIZED_COORDS_FALSE |
+                                    CLK_ADDRESS_CLAMP_TO_EDGE |
+                                    CLK_FILTER_NEAREST;
+
+/*!
+ * \brief Каналы пикселя изображения CL_UNORM_INT8 в [0, 255]
+ */
+int4 readPixel(read_only image2d_t img, int x, int y)
+{
+    return convert_int4_sat_rte(read_imagef(img, clampSampler, (int2)(x, y)) * 255.0f);
+}
+
+/*!
+ * \brief Одна итерация фильтра через текстурный кэш: изображения
+ *        CL_UNORM_INT8, чтение через сэмплер CLK_ADDRESS_CLAMP_TO_EDGE
+ *        (выход за край читает край, индексная арифметика не нужна)
+ * \note граница изображения копируется без изменений, результат совпадает с pm
+ */
+__kernel void pm_image(read_only image2d_t src,
+                       write_only image2d_t dst,
+                       __constant float *lut,
+                       __global uint *change,
+                       int w,
+                       int h)
+{
+    PM_SPECIALIZE(lut, w, h);
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if(x >= w || y >= h) {
+        return;
+    }
+
+    const int4 p = readPixel(src, x, y);
+
+    if(x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+        write_imagef(dst, (int2)(x, y), convert_float4(p) / 255.0f);
+        return;
+    }
+
+    /* порядок суммы как в pm: x-1, x+1, y+1, y-1 */
+    float4 sum = flux(readPixel(src, x - 1, y) - p, lut) +
+                 flux(readPixel(src, x + 1, y) - p, lut);
+    sum = sum + flux(readPixel(src, x, y + 1) - p, lut);
+    sum = sum + flux(readPixel(src, x, y - 1) - p, lut);
+    const int4 rgb = convert_int4(convert_float4(p) + sum) & 0xff;
+    write_imagef(dst, (int2)(x, y), convert_float4(rgb) / 255.0f);
+
+    const uint4 d = abs(rgb - p);
+    const uint m = max(max(d.x, d.y), d.z);
+
+    /* атомарная операция только если максимум может вырасти */
+    if(m > *change) {
+        atomic_max(change, m);
+    }
+}
+
+#ifndef PM_VEC_WIDTH
+#define PM_VEC_WIDTH 4  /* пикселей на рабочий элемент pm_vec (4 или 8), задаётся -D */
+#endif
+
+#define PM_CAT_(a, b)   a##b
+#define PM_CAT(a, b)    PM_CAT_(a, b)
+#define uintv           PM_CAT(uint, PM_VEC_WIDTH)
+#define intv            PM_CAT(int, PM_VEC_WIDTH)
+#define floatv          PM_CAT(float, PM_VEC_WIDTH)
+#define vloadv          PM_CAT(vload, PM_VEC_WIDTH)
+#define vstorev         PM_CAT(vstore, PM_VEC_WIDTH)
+#define convert_intv    PM_CAT(convert_int, PM_VEC_WIDTH)
+#define convert_uintv   PM_CAT(convert_uint, PM_VEC_WIDTH)
+#define convert_floatv  PM_CAT(convert_float, PM_VEC_WIDTH)
+
+/* номера элементов вектора */
+__constant int lanes[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+/*!
+ * \brief Новое значение внутреннего пикселя i (как в pm_local)
+ * \param m - максимальное изменение канала, обновляется
+ */
+uint stepPixel(__global const uint *src, __constant float *lut, int i, int w, uint *m)
+{
+    const int4 p = convert_int4(unpack(src[i]));
+    float4 sum = flux(convert_int4(unpack(src[i - 1])) - p, lut) +
+                 flux(convert_int4(unpack(src[i + 1])) - p, lut);
+    sum = sum + flux(convert_int4(unpack(src[i + w])) - p, lut);
+    sum = sum + flux(convert_int4(unpack(src[i - w])) - p, lut);
+    const int4 rgb = convert_int4(convert_float4(p) + sum);
+    const uint4 d = abs((rgb & 0xff) - p);
+    *m = max(*m, max(max(d.x, d.y), d.z));
+    return PM_RGB(rgb.x, rgb.y, rgb.z);
+}
+
+/*!
+ * \brief Канал (сдвиг shift) вектора пикселей
+ */
+intv channelv(uintv rgb, uint shift)
+{
+    return convert_intv((rgb >> shift) & 0xffu);
+}
+
+/*!
+ * \brief Потоки одного канала вектора пикселей
+ */
+floatv fluxv(intv d, __constant float *lut)
+{
+    int i[PM_VEC_WIDTH];
+    float f[PM_VEC_WIDTH];
+    vstorev(d, 0, i);
+
+    for(int k = 0; k < PM_VEC_WIDTH; ++k) {
+        f[k] = lut[i[k] + PM_LUT_OFFSET];
+    }
+
+    return vloadv(0, f);
+}
+
+/*!
+ * \brief Максимальный элемент вектора
+ */
+uint maxv(uintv d)
+{
+    uint a[PM_VEC_WIDTH];
+    uint m = 0;
+    vstorev(d, 0, a);
+
+    for(int k = 0; k < PM_VEC_WIDTH; ++k) {
+        m = max(m, a[k]);
+    }
+
+    return m;
+}
+
+/*!
+ * \brief Одна итерация фильтра, PM_VEC_WIDTH соседних пикселей строки на
+ *        рабочий элемент: каналы считаются векторами по пикселям (vload),
+ *        без цикла по каналам со switch. Вариант для CPU-устройств, где
+ *        компилятор отображает векторы на SSE/AVX
+ * \note результат совпадает с pm
+ * \note глобальный размер по x - (w + PM_VEC_WIDTH - 1) / PM_VEC_WIDTH
+ */
+__kernel void pm_vec(__global const uint *src,
+                     __global uint *dst,
+                     __constant float *lut,
+                     __global uint *change,
+                     int w,
+                     int h)
+{
+    PM_SPECIALIZE(lut, w, h);
+    const int x = get_global_id(0) * PM_VEC_WIDTH;
+    const int y = get_global_id(1);
+
+    if(x >= w || y >= h) {
+        return;
+    }
+
+    const int i = x + y * w;
+    uint m = 0;
+
+    if(y == 0 || y == h - 1) {
+        for(int k = 0; k < PM_VEC_WIDTH && x + k < w; ++k) {
+            dst[i + k] = src[i + k];
         }
-        bits[x + y * w] = PM_RGB(rgb[0], rgb[1], rgb[2]);
+
+        return;
+    }
+
+    if(x + PM_VEC_WIDTH > w) {
+        /* остаток строки короче вектора */
+        for(int k = 0; x + k < w; ++k) {
+            dst[i + k] = x + k == 0 || x + k == w - 1 ? src[i + k] : stepPixel(src, lut, i + k, w, &m);
+        }
+    } else {
+        /* соседи по строке - векторы со сдвигом на пиксель; у края строки
+           они захватывают соседнюю строку, такие элементы заменяются ниже */
+        const uintv c = vloadv(0, src + i);
+        const uintv l = vloadv(0, src + i - 1);
+        const uintv r = vloadv(0, src + i + 1);
+        const uintv dn = vloadv(0, src + i + w);
+        const uintv up = vloadv(0, src + i - w);
+        uintv rgb = (uintv)(0);
+        uintv d = (uintv)(0);
+
+        for(uint shift = 0; shift < 24; shift += 8) {
+            const intv p = channelv(c, shift);
+            /* порядок суммы как в pm: x-1, x+1, y+1, y-1 */
+            floatv sum = fluxv(channelv(l, shift) - p, lut) +
+                         fluxv(channelv(r, shift) - p, lut);
+            sum = sum + fluxv(channelv(dn, shift) - p, lut);
+            sum = sum + fluxv(channelv(up, shift) - p, lut);
+            const intv v = convert_intv(convert_floatv(p) + sum) & 0xff;
+            rgb = rgb | (convert_uintv(v) << shift);
+            d = max(d, abs(v - p));
+        }
+
+        /* граница изображения копируется без изменений */
+        const intv xs = x + vloadv(0, lanes);
+        const intv edge = (xs == 0) | (xs == w - 1);
+        vstorev(select(rgb, c, edge), 0, dst + i);
+        m = maxv(select(d, (uintv)(0), edge));
     }
-}
\ No newline at end of file
+
+    /* атомарная операция только если максимум может вырасти */
+    if(m > *change) {
+        atomic_max(change, m);
+    }
+}
+
+/*!
+ * \brief Распаковка RGB24 (байты P6, r g b подряд) в пиксели 0x00RRGGBB
+ * \param count - кол-во пикселей
+ */
+__kernel void pm_unpack(__global const uchar *rgb,
+                        __global uint *bits,
+                        int count)
+{
+    const int i = get_global_id(0);
+
+    if(i >= count) {
+        return;
+    }
+
+    const uchar3 c = vload3(i, rgb);
+    bits[i] = PM_RGB(c.x, c.y, c.z);
+}
+
+/*!
+ * \brief Упаковка пикселей 0x00RRGGBB в RGB24 (байты P6) для выгрузки
+ * \param count - кол-во пикселей
+ */
+__kernel void pm_pack(__global const uint *bits,
+                      __global uchar *rgb,
+                      int count)
+{
+    const int i = get_global_id(0);
+
+    if(i >= count) {
+        return;
+    }
+
+    const uint p = bits[i];
+    vstore3((uchar3)((uchar)(p >> 16), (uchar)(p >> 8), (uchar)p), i, rgb);
+}
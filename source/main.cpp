@@ -15,17 +15,27 @@
 
 #include <iostream> /* cout, endl */
 #include <fstream>  /* fstream */
+#include <sstream>  /* stringstream */
 #include <iomanip>  /* setprecision, fixed */
 #include <cstdlib>  /* exit */
+#include <cstdio>   /* sscanf */
+#include <cstring>  /* strcmp, memmove */
 #include <cmath>    /* exp */
 #include <ctime>    /* clock_t */
+#include <chrono>   /* steady_clock */
+#include <vector>   /* vector */
+#include <algorithm> /* max */
 
 extern "C" {
-    #include "pm.h"      /* pm(...)	  */
+    #include "pm.h"        /* pm(...)	  */
+    #include "pm_simd.h"   /* pm_simd_limit(...) */
 }
 
-#include "pm_ocl.hpp"    /* pm_parallel(...) */
-#include "ppm_image.hpp" /* PPMImage  */
+#include "pm_ocl.hpp"    /* pm_parallel(...), pm_multi(...) */
+#include "pm_cpu.hpp"    /* pm_cpu(...) */
+#include "pm_hetero.hpp" /* pm_hetero(...) */
+#include "pm_pipeline.hpp" /* pm_pipeline(...) */
+#include "ppm_image.hpp" /* PPMImage, MappedPPM, PPMReader, PPMWriter */
 
 #define VERSION "1.0"
 
@@ -35,6 +45,11 @@ extern "C" {
 char *getArgOption(char **, char **, const char *);
 bool isArgOption(char **, char **, const char *);
 void printHelp();
+void benchConduction(float thresh, float lambda);
+int runBatch(const std::string &list, proc_data *pdata, cl_data *cdata);
+int runTune(const std::string &image, proc_data *pdata, cl_data *cdata);
+int runStream(const std::string &src, const std::string &dest, int strip, proc_data *pdata, cl_data *cdata);
+int runPipeline(const std::string &src, const std::string &dest, proc_data *pdata, int stages, bool verbose, bool profile);
 
 //---------------------------------------------------------------
 // Точка входа
@@ -47,11 +62,24 @@ int main(int argc, char *argv[])
     float thresh = 30.0f;
     int conduction_function = 1; /* [0, 1] */
     const float lambda = 0.25f;
+    float epsilon = 0.0f;   /* 0 - выполнить все итерации */
     int platformId = -1;
     int deviceId = -1;
-    int run_mode = 1;   /*[0,1,2]*/
+    int run_mode = 1;   /*[0,1,2,3,4,5]*/
+    int threads = 0;    /* 0 - по числу ядер */
+    int tile_w = 0;     /* 0 - без временного блокирования */
+    int tile_h = 0;
+    int tile_iterations = 4;
     std::string kernel_file = "kernel.cl";
     std::string bitcode_file;
+    std::string list_file;
+    std::string tune_file;
+    std::string cache_dir = "pm_cache";
+    int specialize = 0;     /* 0 - без специализации программы */
+    bool multi_device = false;
+    std::vector<int> devices;   /* несколько устройств (пусто - все устройства платформы) */
+    size_t tile_pixels = 0;     /* обработка по частям: 0 - только если не помещается на устройство */
+    int stream_rows = 0;        /* потоковая обработка полосами: 0 - выкл. */
 
     /* считывание аргументов командной строки */
     
@@ -88,6 +116,12 @@ int main(int argc, char *argv[])
         exit(EXIT_SUCCESS); // -> EXIT_SUCCESS
     }
 
+    if(isArgOption(argv, argv + argc, "-bl")) { /* сравнение таблицы потоков с функциями */
+        char *thresh_str = getArgOption(argv, argv + argc, "-t");
+        benchConduction(thresh_str ? atoi(thresh_str) : thresh, lambda);
+        exit(EXIT_SUCCESS); // -> EXIT_SUCCESS
+    }
+
     char *dinfo_str = getArgOption(argv, argv + argc, "-di");   /* список устройств для платформы */
 
     if(dinfo_str) {
@@ -138,9 +172,21 @@ int main(int argc, char *argv[])
         char *conduction_function_str = getArgOption(argv, argv + argc, "-f");  /* функция для получения коэффициента сглаживания */
         char *platform_str  = getArgOption(argv, argv + argc, "-p");        /* индекс платформы */
         char *device_str    = getArgOption(argv, argv + argc, "-d");        /* индекс устройства */
-        char *rmode_str     = getArgOption(argv, argv + argc, "-r");        /* режим запуска [0,1,2] */
+        char *rmode_str     = getArgOption(argv, argv + argc, "-r");        /* режим запуска [0,1,2,3,4,5] */
         char *kernel_file_str = getArgOption(argv, argv + argc, "-k");      /* файл с ядром программы */
-        char *bitcode_file_str = getArgOption(argv, argv + argc, "-b");     /* файл с бит кодом */
+        char *bitcode_file_str = getArgOption(argv, argv + argc, "-b");     /* файл с бинарной программой */
+        char *cache_str     = getArgOption(argv, argv + argc, "-c");        /* каталог кэша программ */
+        char *isa_str       = getArgOption(argv, argv + argc, "-x");        /* ограничение набора инструкций */
+        char *threads_str   = getArgOption(argv, argv + argc, "-j");        /* кол-во потоков CPU */
+        char *tile_str      = getArgOption(argv, argv + argc, "-T");        /* размер плитки CPU */
+        char *tile_it_str   = getArgOption(argv, argv + argc, "-K");        /* итераций на плитку */
+        char *epsilon_str   = getArgOption(argv, argv + argc, "-e");        /* порог сходимости */
+        char *list_str      = getArgOption(argv, argv + argc, "-l");        /* список изображений */
+        char *tune_str      = getArgOption(argv, argv + argc, "-at");       /* изображение для настройки */
+        char *spec_str      = getArgOption(argv, argv + argc, "-s");        /* специализация программы */
+        char *multi_str     = getArgOption(argv, argv + argc, "-m");        /* список устройств */
+        char *ooc_str       = getArgOption(argv, argv + argc, "-o");        /* предел тайла (по частям) */
+        char *stream_str    = getArgOption(argv, argv + argc, "-S");        /* высота полосы (потоковая) */
 
         if(iter_str) iterations = atoi(iter_str);
 
@@ -154,7 +200,47 @@ int main(int argc, char *argv[])
 
         if(rmode_str) run_mode = atoi(rmode_str);
 
-        if(run_mode < 0 || run_mode > 2) run_mode = 2;
+        if(run_mode < 0 || run_mode > 5) run_mode = 2;
+
+        if(isa_str) pm_simd_limit(atoi(isa_str));
+
+        if(threads_str) threads = atoi(threads_str);
+
+        if(threads < 0) threads = 0;
+
+        /* <ширина>[x<высота>] */
+        if(tile_str && sscanf(tile_str, "%dx%d", &tile_w, &tile_h) == 1) tile_h = tile_w;
+
+        if(tile_it_str) tile_iterations = atoi(tile_it_str);
+
+        if(tile_w < 0 || tile_h < 0) tile_w = tile_h = 0;
+
+        if(tile_iterations < 1) tile_iterations = 1;
+
+        if(epsilon_str) epsilon = atof(epsilon_str);
+
+        if(list_str) list_file = std::string(list_str);
+
+        if(tune_str) tune_file = std::string(tune_str);
+
+        if(spec_str) specialize = atoi(spec_str);
+
+        if(ooc_str && atoll(ooc_str) > 0) tile_pixels = (size_t)atoll(ooc_str);
+
+        if(stream_str) stream_rows = std::max(atoi(stream_str), 0);
+
+        /* <индекс>[,<индекс>...] или all */
+        if(multi_str) {
+            multi_device = true;
+            std::stringstream ss(multi_str);
+            std::string idx;
+
+            while(strcmp(multi_str, "all") && std::getline(ss, idx, ',')) {
+                devices.push_back(atoi(idx.c_str()));
+            }
+        }
+
+        if(cache_str) cache_dir = strcmp(cache_str, "-") ? std::string(cache_str) : std::string();
 
         if(kernel_file_str) { 
             kernel_file = std::string(kernel_file_str);
@@ -171,7 +257,7 @@ int main(int argc, char *argv[])
         if(bitcode_file_str) { 
             bitcode_file = std::string(bitcode_file_str);
             if(bitcode_file.empty()) {
-                std::cerr << "Error: empty bitcode file.\n";
+                std::cerr << "Error: empty program binary file.\n";
                 exit(EXIT_FAILURE);
             }
             std::ifstream in(bitcode_file);
@@ -193,15 +279,58 @@ int main(int argc, char *argv[])
                 << conduction_function << std::endl;
         std::cout << "conduction function threshold for edge enhancement: "
                 << thresh << std::endl;
+        std::cout << "convergence threshold: " << epsilon << std::endl;
         std::cout << "run mode: " << run_mode << std::endl;
+        std::cout << "program specialization: " << specialize << std::endl;
         std::cout << "reading input image..." << std::endl;
     }
 
+    /* выбор функции для вычисления коэффициента проводимости */
+    conduction conduction_ptr = conduction_function ? &pm_exponential : &pm_quadric;
+    proc_data pdata = {iterations, conduction_function, conduction_ptr, thresh, lambda, NULL, epsilon, NULL};
+    /* таблица потоков строится один раз на запуск */
+    float lut[PM_LUT_SIZE];
+    pm_lut_init(lut, &pdata);
+    pdata.lut = lut;
+    /* параметры opencl - общие для всех режимов */
+    cl_data cdata = { platformId, deviceId, profile, kernel_file, false, verbose, cache_dir, specialize, tile_pixels };
+    if(!bitcode_file.empty()) {
+        cdata.filename = bitcode_file;
+        cdata.bitcode = true;
+    }
+
+    if(!list_file.empty()) {    /* серия изображений в одном сеансе OpenCL */
+        exit(runBatch(list_file, &pdata, &cdata));
+    }
+
+    if(!tune_file.empty()) {    /* настройка варианта ядра для устройства */
+        exit(runTune(tune_file, &pdata, &cdata));
+    }
+
+    if(stream_rows > 0) {       /* потоковая обработка полосами с ореолом */
+        exit(runStream(src, dest, stream_rows, &pdata, &cdata));
+    }
+
+    if(run_mode == 5) {         /* конвейер итераций над строками, файл читается построчно */
+        exit(runPipeline(src, dest, &pdata, threads, verbose, profile));
+    }
+
+    /* байты P6 упаковываются на устройстве: параллельная фильтрация на одном устройстве,
+       исходный и результирующий файлы отображаются в память */
+    const bool device_rgb = run_mode == 1 && !multi_device;
+
     /* загрузка изображения (.ppm) */
     PPMImage input_img;
+    MappedPPM mapped_src;
 
     try {
-        input_img = PPMImage::toRGB(PPMImage::load(src));
+        if(device_rgb) {
+            mapped_src.open(src);
+            input_img.width = mapped_src.width;
+            input_img.height = mapped_src.height;
+        } else {
+            input_img = PPMImage::toRGB(PPMImage::load(src));
+        }
     } catch(std::invalid_argument e) {
         std::cerr << e.what() << std::endl;
         exit(EXIT_FAILURE);
@@ -209,15 +338,17 @@ int main(int argc, char *argv[])
 
     /* "упаковка" rgb каналов в unsigned int */
     unsigned int *packed_data = nullptr;
-    size_t packed_size = input_img.packData(&packed_data);
-    input_img.clear();
+    size_t packed_size = 0;
+
+    if(!device_rgb) {
+        packed_size = input_img.packData(&packed_data);
+        input_img.clear();
+    }
+
     /* данные изображения и параметры обработки */
     img_data idata = { packed_data, packed_size,
                        input_img.width, input_img.height
                      };
-    /* выбор функции для вычисления коэффициента проводимости */
-    conduction conduction_ptr = conduction_function ? &pm_exponential : &pm_quadric;
-    proc_data pdata = {iterations, conduction_function, conduction_ptr, thresh, lambda};
     /* отфильтрованное изображение */
     PPMImage ouput_img(idata.w, idata.h);
 
@@ -229,15 +360,45 @@ int main(int argc, char *argv[])
            std::cout << "processing sequentially..." << std::endl;
         }
         
+        /* доля активных плиток по итерациям */
+        std::vector<float> active(std::max(iterations, 0));
+        pdata.active = (verbose || profile) ? active.data() : NULL;
+        int performed;
+
         if(profile) {
             clock_t start = clock();
-            pm(&idata, &pdata);  /* Запуск последовательной фильтрации */
+            performed = pm(&idata, &pdata);  /* Запуск последовательной фильтрации */
             clock_t end = clock();
             double timeSpent = (end-start)/(double)CLOCKS_PER_SEC;
             std::cout << "sequential execution time in milliseconds = " << std::fixed
                     << std::setprecision(3) << (timeSpent * 1000.0) << " ms" << std::endl;
         } else {
-            pm(&idata, &pdata);  /* Запуск последовательной фильтрации */
+            performed = pm(&idata, &pdata);  /* Запуск последовательной фильтрации */
+        }
+
+        pdata.active = NULL;
+
+        if(performed < 0) {
+            std::cerr << "Not enough memory for tile map!" << std::endl;
+            delete[] packed_data;
+            exit(EXIT_FAILURE);
+        }
+
+        if(verbose) {
+            for(int it = 0; it < performed; ++it) {
+                std::cout << "iteration " << it << ": active tiles " << std::fixed
+                          << std::setprecision(1) << (active[it] * 100.0f) << "%" << std::endl;
+            }
+        }
+
+        if(verbose || profile) {
+            double sum = 0.0;
+
+            for(int it = 0; it < performed; ++it) sum += active[it];
+
+            std::cout << "sequential iterations performed: " << performed << std::endl;
+            std::cout << "sequential active tiles = " << std::fixed << std::setprecision(1)
+                      << (performed > 0 ? sum * 100.0 / performed : 0.0) << "% (average)" << std::endl;
         }
 
         if(verbose) {
@@ -257,6 +418,88 @@ int main(int argc, char *argv[])
         packed_data = nullptr;
     }
 
+    //---------------------------------------------------------------------------------
+    // многопоточная фильтрация на CPU (float-плоскости)
+    //---------------------------------------------------------------------------------
+    if(run_mode == 3) {
+        if(verbose) {
+            std::cout << "processing on cpu..." << std::endl;
+        }
+
+        ThreadPool pool(threads);
+        cpu_data cpu = { &pool, pm_simd_detect(), tile_w, tile_h, tile_iterations, profile, verbose };
+
+        try
+        {
+            int performed;
+
+            if(profile) {
+                auto start = std::chrono::steady_clock::now();
+                performed = pm_cpu(&idata, &pdata, &cpu);  /* Запуск многопоточной фильтрации */
+                auto end = std::chrono::steady_clock::now();
+                double timeSpent = std::chrono::duration<double>(end - start).count();
+                std::cout << "cpu execution time in milliseconds = " << std::fixed
+                        << std::setprecision(3) << (timeSpent * 1000.0) << " ms" << std::endl;
+            } else {
+                performed = pm_cpu(&idata, &pdata, &cpu);  /* Запуск многопоточной фильтрации */
+            }
+
+            if(verbose || profile) {
+                std::cout << "cpu iterations performed: " << performed << std::endl;
+            }
+
+            if(verbose) {
+                std::cout << "saving image..." << std::endl;
+            }
+
+            ouput_img.unpackData(idata.bits, packed_size);
+            PPMImage::save(PPMImage::toRGB(ouput_img), std::string(dest));
+        } catch(std::invalid_argument e) {
+            std::cerr << e.what();
+        } catch(std::runtime_error e) {
+            std::cerr << e.what();
+        }
+
+        delete[] packed_data;
+        packed_data = nullptr;
+    }
+
+    //---------------------------------------------------------------------------------
+    // совместная фильтрация: устройство OpenCL и потоки CPU
+    //---------------------------------------------------------------------------------
+    if(run_mode == 4) {
+        if(verbose) {
+            std::cout << "processing on opencl device and cpu..." << std::endl;
+        }
+
+        ThreadPool pool(threads);
+
+        try
+        {
+            int performed = pm_hetero(&idata, &pdata, &cdata, &pool);
+
+            if(verbose || profile) {
+                std::cout << "co-execution iterations performed: " << performed << std::endl;
+            }
+
+            if(verbose) {
+                std::cout << "saving image..." << std::endl;
+            }
+
+            ouput_img.unpackData(idata.bits, packed_size);
+            PPMImage::save(PPMImage::toRGB(ouput_img), std::string(dest));
+        } catch (cl::Error err) {
+            std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+        } catch(std::invalid_argument e) {
+            std::cerr << e.what();
+        } catch(std::runtime_error e) {
+            std::cerr << e.what();
+        }
+
+        delete[] packed_data;
+        packed_data = nullptr;
+    }
+
     //---------------------------------------------------------------------------------
     // параллельная фильтрация
     //---------------------------------------------------------------------------------
@@ -265,27 +508,48 @@ int main(int argc, char *argv[])
             std::cout << "processing in parallel..." << std::endl;
         }
 
-        input_img = PPMImage::toRGB(PPMImage::load(src));
-        packed_size = input_img.packData(&packed_data);
-        input_img.clear();
-        
-        cl_data cdata = { platformId, deviceId, profile, kernel_file, false, verbose};
-        if(!bitcode_file.empty()) {
-            cdata.filename = bitcode_file;
-            cdata.bitcode = true;
+        if(!packed_data && !device_rgb) {
+            /* данные были изменены последовательной фильтрацией */
+            input_img = PPMImage::toRGB(PPMImage::load(src));
+            packed_size = input_img.packData(&packed_data);
+            input_img.clear();
+            idata.bits = packed_data;
+            idata.size = packed_size;
+            ouput_img.clear();
         }
+        
+        MappedPPM mapped_dst;
 
         try
         {
             /* запуск параллельной фильтрации */
-            pm_parallel(&idata, &pdata, &cdata);
+            int performed;
+
+            if(device_rgb) {
+                /* результат выгружается прямо в отображение файла */
+                mapped_dst.create(dest, mapped_src.width, mapped_src.height);
+                performed = pm_parallel_rgb(mapped_src.pixels(), mapped_dst.writablePixels(),
+                                            mapped_src.width, mapped_src.height, &pdata, &cdata);
+            } else if(multi_device) {
+                performed = pm_multi(&idata, &pdata, &cdata, devices);
+            } else {
+                performed = pm_parallel(&idata, &pdata, &cdata);
+            }
+
+            if(verbose || profile) {
+                std::cout << "parallel iterations performed: " << performed << std::endl;
+            }
             
             if(verbose) {
                 std::cout << "saving image..." << std::endl;
             }
             
-            ouput_img.unpackData(idata.bits, packed_size);
-            PPMImage::save(PPMImage::toRGB(ouput_img), std::string(dest));
+            if(device_rgb) {
+                mapped_dst.close();
+            } else {
+                ouput_img.unpackData(idata.bits, packed_size);
+                PPMImage::save(PPMImage::toRGB(ouput_img), std::string(dest));
+            }
             
         } catch (cl::Error err) {  
             std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
@@ -361,6 +625,321 @@ bool isArgOption(char **begin, char **end, const char *option)
     return false;
 }
 /*!
+* \brief Микро-бенчмарк: вычисление потоков функциями проводимости
+*        в сравнении с таблицей потоков
+*/
+void benchConduction(float thresh, float lambda)
+{
+    const int count = 1 << 22;
+    std::vector<int> deltas(count);
+    unsigned int seed = 12345u;
+
+    for(int i = 0; i < count; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        deltas[i] = (int)(seed >> 16) % (PM_LUT_OFFSET + 1) * ((seed & 1) ? 1 : -1);
+    }
+
+    const char *names[] = { "quadric", "exponential" };
+    const conduction funcs[] = { &pm_quadric, &pm_exponential };
+
+    for(int f = 0; f < 2; ++f) {
+        proc_data pdata = { 1, f, funcs[f], thresh, lambda, NULL, 0.0f, NULL };
+        float lut[PM_LUT_SIZE];
+        volatile float sink = 0.0f;
+        float sum = 0.0f;
+        clock_t start = clock();
+
+        for(int i = 0; i < count; ++i) {
+            sum += lambda * pdata.conduction_ptr(abs(deltas[i]), thresh) * deltas[i];
+        }
+
+        double func_time = (clock() - start) / (double)CLOCKS_PER_SEC;
+        sink = sum;
+        sum = 0.0f;
+        start = clock();
+        pm_lut_init(lut, &pdata);
+
+        for(int i = 0; i < count; ++i) {
+            sum += lut[deltas[i] + PM_LUT_OFFSET];
+        }
+
+        double lut_time = (clock() - start) / (double)CLOCKS_PER_SEC;
+        sink = sum;
+        (void)sink;
+        std::cout << names[f] << ": function " << std::fixed << std::setprecision(3)
+                  << (func_time * 1000.0) << " ms, table " << (lut_time * 1000.0) << " ms, speedup x"
+                  << std::setprecision(2) << (lut_time > 0.0 ? func_time / lut_time : 0.0)
+                  << " (" << count << " evaluations)" << std::endl;
+    }
+}
+/*!
+* \brief Обработка серии изображений в одном сеансе OpenCL: конвейер
+*        загрузки, вычисления и выгрузки (PMSession::pipeline)
+* \param list - файл, каждая строка: <источник.ppm> <результат.ppm>
+* \return EXIT_SUCCESS, EXIT_FAILURE - хотя бы одно изображение не обработано
+*/
+int runBatch(const std::string &list, proc_data *pdata, cl_data *cdata)
+{
+    std::ifstream in(list);
+
+    if(in.fail()) {
+        std::cerr << "Error: file " << list << " does not exist.\n";
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    int count = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        PMSession session(*cdata);  /* устройство, контекст и программа - один раз */
+        double setup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if(cdata->profile) {
+            std::cout << "session setup time in milliseconds = " << std::fixed
+                      << std::setprecision(3) << (setup * 1000.0) << " ms" << std::endl;
+        }
+
+        std::vector<std::string> destinations;
+        unsigned int *packed_data = nullptr;   /* последнее загруженное изображение */
+
+        /* загрузка следующего изображения списка, пока вычисляется предыдущее */
+        auto load = [&](img_data &idata) {
+            std::string src, dest;
+
+            while(in >> src >> dest) {
+                if(cdata->verbose) {
+                    std::cout << "processing " << src << " -> " << dest << "..." << std::endl;
+                }
+
+                try
+                {
+                    PPMImage input_img = PPMImage::toRGB(PPMImage::load(src));
+                    delete[] packed_data;
+                    packed_data = nullptr;
+                    size_t packed_size = input_img.packData(&packed_data);
+                    idata = { packed_data, packed_size, input_img.width, input_img.height };
+                    destinations.push_back(dest);
+                    return true;
+                } catch(std::invalid_argument e) {
+                    std::cerr << e.what() << std::endl;
+                    status = EXIT_FAILURE;
+                }
+            }
+
+            return false;
+        };
+
+        /* сохранение результата, пока вычисляются следующие */
+        auto store = [&](int index, const img_data &idata) {
+            try
+            {
+                PPMImage ouput_img(idata.w, idata.h);
+                ouput_img.unpackData(idata.bits, idata.size);
+                PPMImage::save(PPMImage::toRGB(ouput_img), destinations[index]);
+                ++count;
+            } catch(std::invalid_argument e) {
+                std::cerr << e.what() << std::endl;
+                status = EXIT_FAILURE;
+            }
+        };
+
+        try
+        {
+            session.pipeline(pdata, load, store);
+        } catch(...) {
+            delete[] packed_data;
+            throw;
+        }
+
+        delete[] packed_data;
+    } catch (cl::Error err) {
+        std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::invalid_argument e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(cdata->profile) {
+        double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "batch of " << count << " images in milliseconds = " << std::fixed
+                  << std::setprecision(3) << (total * 1000.0) << " ms" << std::endl;
+    }
+
+    return status;
+}
+/*!
+* \brief Подбор варианта ядра и размера рабочей группы на изображении
+*        image; результат сохраняется в файл настройки устройства
+* \return EXIT_SUCCESS, EXIT_FAILURE
+*/
+int runTune(const std::string &image, proc_data *pdata, cl_data *cdata)
+{
+    try
+    {
+        PPMImage input_img = PPMImage::toRGB(PPMImage::load(image));
+        unsigned int *packed_data = nullptr;
+        size_t packed_size = input_img.packData(&packed_data);
+        img_data idata = { packed_data, packed_size, input_img.width, input_img.height };
+        input_img.clear();
+
+        try
+        {
+            PMSession session(*cdata);
+            session.tune(&idata, pdata);
+        } catch(...) {
+            delete[] packed_data;
+            throw;
+        }
+
+        delete[] packed_data;
+    } catch (cl::Error err) {
+        std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::invalid_argument e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+* \brief Потоковая обработка: файл читается полосами по strip строк,
+*        полоса обрабатывается с ореолом в iterations строк сверху и снизу
+*        (края области - неподвижная граница, ошибка не доходит до полосы),
+*        готовые строки сразу записываются в результат.
+*        Память - O(ширина * (strip + 2 * iterations)) при любой высоте.
+* \note выполняются все итерации, порог сходимости не используется
+* \return EXIT_SUCCESS, EXIT_FAILURE
+*/
+int runStream(const std::string &src, const std::string &dest, int strip, proc_data *pdata, cl_data *cdata)
+{
+    try
+    {
+        PPMReader reader;
+        PPMWriter writer;
+        reader.open(src);
+        writer.create(dest, reader.width, reader.height);
+        const int w = reader.width, h = reader.height;
+        const int k = pdata->iterations;
+        const size_t row = (size_t)w * 3;
+        /* ореол рассчитан на все итерации */
+        proc_data pd = *pdata;
+        pd.epsilon = 0.0f;
+        /* область: ореол, полоса, ореол */
+        std::vector<unsigned char> region((size_t)(strip + 2 * k) * row), result(region.size());
+        PMSession session(*cdata);
+        int top = 0;        /* первая строка области в буфере */
+        int loaded = 0;     /* строк области в буфере */
+        auto start = std::chrono::steady_clock::now();
+
+        if(cdata->verbose) {
+            std::cout << "streaming: strips of " << strip << " rows, halo " << k << " rows, "
+                      << (2 * region.size() / 1048576.0) << " MB host buffers" << std::endl;
+        }
+
+        for(int y0 = 0; y0 < h; y0 += strip) {
+            const int y1 = std::min(y0 + strip, h);
+            const int r0 = std::max(y0 - k, 0), r1 = std::min(y1 + k, h);
+            /* строки [r0, top + loaded) уже прочитаны: сдвиг к началу буфера */
+            const int keep = top + loaded - r0;
+            memmove(region.data(), region.data() + (size_t)(r0 - top) * row, keep * row);
+            reader.readRows(region.data() + keep * row, r1 - r0 - keep);
+            top = r0;
+            loaded = r1 - r0;
+            session.runRGB(region.data(), result.data(), w, r1 - r0, &pd);
+            writer.writeRows(result.data() + (size_t)(y0 - r0) * row, y1 - y0);
+        }
+
+        writer.close();
+
+        if(cdata->profile) {
+            double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "streaming time in milliseconds = " << std::fixed
+                      << std::setprecision(3) << (total * 1000.0) << " ms" << std::endl;
+        }
+    } catch (cl::Error err) {
+        std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::invalid_argument e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+/*!
+* \brief Конвейер итераций на CPU: строки читаются из файла по одной,
+*        проходят через потоки-стадии и сразу записываются в результат.
+*        Память - несколько строк на стадию при любой высоте.
+* \note выполняются все итерации, порог сходимости не используется
+* \return EXIT_SUCCESS, EXIT_FAILURE
+*/
+int runPipeline(const std::string &src, const std::string &dest, proc_data *pdata, int stages, bool verbose, bool profile)
+{
+    try
+    {
+        PPMReader reader;
+        PPMWriter writer;
+        reader.open(src);
+        writer.create(dest, reader.width, reader.height);
+        const int w = reader.width;
+        std::vector<unsigned char> in((size_t)w * 3), out(in.size());
+        auto start = std::chrono::steady_clock::now();
+
+        /* упаковка в 0x00RRGGBB - в потоке чтения, распаковка - в потоке записи */
+        int performed = pm_pipeline(w, reader.height, [&](uint *row) {
+            reader.readRows(in.data(), 1);
+
+            for(int x = 0; x < w; ++x) {
+                const unsigned char *p = &in[(size_t)x * 3];
+                row[x] = ((uint)p[0] << 16) | ((uint)p[1] << 8) | p[2];
+            }
+        }, [&](const uint *row) {
+            for(int x = 0; x < w; ++x) {
+                unsigned char *p = &out[(size_t)x * 3];
+                p[0] = (row[x] >> 16) & 0xff;
+                p[1] = (row[x] >> 8) & 0xff;
+                p[2] = row[x] & 0xff;
+            }
+
+            writer.writeRows(out.data(), 1);
+        }, pdata, stages, verbose);
+
+        writer.close();
+
+        if(verbose || profile) {
+            std::cout << "pipeline iterations performed: " << performed << std::endl;
+        }
+
+        if(profile) {
+            double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "pipeline time in milliseconds = " << std::fixed
+                      << std::setprecision(3) << (total * 1000.0) << " ms" << std::endl;
+        }
+    } catch(std::invalid_argument e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+/*!
 * \brief Краткое руководство к запуску программы
 */
 void printHelp()
@@ -373,28 +952,55 @@ void printHelp()
               "USAGE" << std::endl <<
               "-----" << std::endl << 
               std::endl <<
-              "./pm [-i -t -f -p -d -r -k -b -g -v] source_file.ppm destination_file.ppm" << std::endl <<
+              "./pm [-i -t -f -e -p -d -m -r -k -b -c -s -o -S -x -j -T -K -l -g -v] source_file.ppm destination_file.ppm" << std::endl <<
               "----------------------------------------------------------------" << std::endl <<
               "   -i <iterations>" << std::endl <<
               "   -t <conduction function threshold> ]" << std::endl <<
               "   -f <conduction function (0-quadric [wide regions over smaller ones]," <<
               "1-exponential [high-contrast edges over low-contrast])>"  << std::endl <<
+              "   -e <convergence threshold: stop when max channel change per iteration is below it (0-off {default})>" << std::endl <<
               "   -p <platform idx>"  << std::endl <<
               "   -d <device idx>"  << std::endl <<
-              "   -r <run mode (0-sequential, 1-parallel {default}, 2-both )>"  << std::endl <<
+              "   -m <device idx list '0,1,...' or 'all': split the image into strips across devices>"  << std::endl <<
+              "   -r <run mode (0-sequential, 1-parallel {default}, 2-both, 3-cpu planar float, multithreaded, 4-opencl device + cpu threads, dynamic split," <<
+              " 5-cpu row pipeline, one thread per block of iterations, rows read and written one at a time)>"  << std::endl <<
               "   -k <kernel file (default:kernel.cl)>" << std::endl <<
-              "   -b <bitcode file>" << std::endl <<
+              "   -b <program binary file (CL_PROGRAM_BINARIES of the selected device)>" << std::endl <<
+              "   -c <program binary and tuning cache directory (default:pm_cache, '-' disables)>" << std::endl <<
+              "   -s <program specialization by build options (0-off {default}, 1-conduction table," <<
+              " 2-conduction table and image size)>" << std::endl <<
+              "   -o <out-of-core tile size limit in pixels, halo included (0-device memory {default})>" << std::endl <<
+              "   -S <streaming: read, filter and write the image in strips of this many rows, halo = iterations (0-off {default})>" << std::endl <<
+              "   -x <max cpu instruction set for run mode 3 (0-scalar, 1-sse4.1, 2-avx2, 3-avx512 {default})>" << std::endl <<
+              "   -j <cpu threads for run modes 3 and 4, pipeline stages for run mode 5 (0-all cores {default})>" << std::endl <<
+              "   -T <cpu tile size <w>[x<h>] for temporal blocking in run mode 3 (0-off {default})>" << std::endl <<
+              "   -K <iterations per cpu tile (default:4)>" << std::endl <<
+              "   -l <list file: '<source.ppm> <destination.ppm>' per line, run mode 1 in one OpenCL session, upload/compute/download pipelined>" << std::endl <<
               "   -g - profile" << std::endl <<
               "   -v - verbose" << std::endl << std::endl <<
-              "./pm [-pi -di -h]" << std::endl <<
-              "-----------------" << std::endl <<
+              "./pm [-pi -di -at -bl -h]" << std::endl <<
+              "-------------------------" << std::endl <<
               "   -pi (shows platform list)"  << std::endl <<
               "   -di <platform index> (shows devices list)" << std::endl <<
+              "   -at <image.ppm> [-p -d -i -k -c -v] (tunes kernel variant and work group size for the device," << std::endl <<
+              "       stores the result in the cache directory, later runs load it)" << std::endl <<
+              "   -bl [-t <threshold>] (benchmarks conduction lookup table)" << std::endl <<
               "   -h (help)" << std::endl << std::endl <<
               "Examples" << std::endl <<
               "-------" << std::endl <<
               "   ./pm -v -i 16 -t 30 -f 1 in.ppm out.ppm"<< std::endl <<
               "   ./pm -g in.ppm out.ppm"<< std::endl <<
+              "   ./pm -r 3 -j 8 in.ppm out.ppm"<< std::endl <<
+              "   ./pm -r 4 -p 0 -d 0 -v in.ppm out.ppm"<< std::endl <<
+              "   ./pm -o 4194304 -i 32 -v panorama.ppm out.ppm"<< std::endl <<
+              "   ./pm -S 256 -i 16 scan.ppm out.ppm"<< std::endl <<
+              "   ./pm -r 5 -j 4 -i 16 -g scan.ppm out.ppm"<< std::endl <<
+              "   ./pm -r 3 -T 512x64 -K 4 -g in.ppm out.ppm"<< std::endl <<
+              "   ./pm -r 3 -i 1000 -e 0.2 -v in.ppm out.ppm"<< std::endl <<
               "   ./pm -k kernel/kernel.cl in.ppm out.ppm"<< std::endl <<
-              "   ./pm -b kernel.gpu_64.bc in.ppm out.ppm"<< std::endl;
+              "   ./pm -b kernel.gpu_64.bc in.ppm out.ppm"<< std::endl <<
+              "   ./pm -g -l images.txt"<< std::endl <<
+              "   ./pm -s 1 -g -l images.txt"<< std::endl <<
+              "   ./pm -p 0 -m all -v in.ppm out.ppm"<< std::endl <<
+              "   ./pm -at in.ppm -p 0 -d 0 -v"<< std::endl;
 }
\ No newline at end of file
@@ -8,7 +8,7 @@
 #include "pm.h"
 
 #include <math.h>   /* exp */
-#include <stdlib.h> /* abs */
+#include <stdlib.h> /* abs, malloc */
 
 #define PM_RED(rgb)     (( (rgb) >> 16) & 0xffu)
 #define PM_GREEN(rgb)   (( (rgb) >> 8 ) & 0xffu)
@@ -28,33 +28,304 @@ static int getChannel(uint rgb, int channel)
     return 0;
 }
 
-static int applyChannel(img_data *idata, proc_data *pdata, int x, int y, int ch)
+static int applyChannel(const img_data *idata, const float *lut, int x, int y, int ch)
 {
     int p = getChannel(idata->bits[x + y * idata->w], ch);
     int deltaW = getChannel(idata->bits[x + (y-1) * idata->w], ch) - p;
     int deltaE = getChannel(idata->bits[x + (y+1) * idata->w], ch) - p;
     int deltaS = getChannel(idata->bits[x+1 + y * idata->w], ch) - p;
     int deltaN = getChannel(idata->bits[x-1 + y * idata->w], ch) - p;
-    float cN = pdata->conduction_ptr(abs(deltaN), pdata->thresh);
-    float cS = pdata->conduction_ptr(abs(deltaS), pdata->thresh);
-    float cE = pdata->conduction_ptr(abs(deltaE), pdata->thresh);
-    float cW = pdata->conduction_ptr(abs(deltaW), pdata->thresh);
-    return p + pdata->lambda * (cN * deltaN + cS * deltaS + cE * deltaE + cW * deltaW);
+    return p + (lut[deltaN + PM_LUT_OFFSET] + lut[deltaS + PM_LUT_OFFSET] +
+                lut[deltaE + PM_LUT_OFFSET] + lut[deltaW + PM_LUT_OFFSET]);
 }
 
-void pm(img_data *idata, proc_data *pdata)
+#define PM_TILE 32  /* сторона плитки карты активности, px */
+
+/*!
+ * \brief Карта активных плиток: плитки текущей итерации хранятся в
+ *        min-куче (обход в порядке строк, как у попиксельного прохода),
+ *        плитки следующей итерации - в списке; метки исключают повторы
+ */
+typedef struct {
+    int tiles_x;
+    int tiles_y;
+    int *heap;      /* плитки текущей итерации */
+    int heap_size;
+    int *next;      /* плитки следующей итерации */
+    int next_size;
+    int *heap_mark; /* номер итерации (с 1), в куче которой плитка */
+    int *next_mark;
+} tile_map;
+
+static void siftDown(int *heap, int size, int i)
+{
+    for(;;) {
+        int m = i, l = 2 * i + 1, r = l + 1;
+
+        if(l < size && heap[l] < heap[m]) m = l;
+
+        if(r < size && heap[r] < heap[m]) m = r;
+
+        if(m == i) return;
+
+        int t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+static int heapPop(tile_map *tm)
+{
+    int top = tm->heap[0];
+    tm->heap[0] = tm->heap[--tm->heap_size];
+    siftDown(tm->heap, tm->heap_size, 0);
+    return top;
+}
+
+static void heapPush(tile_map *tm, int tile, int stamp)
+{
+    if(tm->heap_mark[tile] == stamp) return;
+
+    tm->heap_mark[tile] = stamp;
+    int i = tm->heap_size++;
+
+    while(i > 0 && tm->heap[(i - 1) / 2] > tile) {
+        tm->heap[i] = tm->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    tm->heap[i] = tile;
+}
+
+static void nextPush(tile_map *tm, int tile, int stamp)
+{
+    if(tm->next_mark[tile] == stamp) return;
+
+    tm->next_mark[tile] = stamp;
+    tm->next[tm->next_size++] = tile;
+}
+
+/*!
+ * \brief Следующая итерация: список становится кучей
+ */
+static void nextIteration(tile_map *tm)
 {
-    for(int it = 0; it < pdata->iterations; ++it) {
-        for(int y = 1; y < idata->h-1; ++y) {
-            for(int x = 1; x < idata->w-1; ++x) {
-                int r = applyChannel(idata, pdata, x, y, 0);
-                int g = applyChannel(idata, pdata, x, y, 1);
-                int b = applyChannel(idata, pdata, x, y, 2);
-                int a = getChannel(idata->bits[x+y*idata->w], 3);
-                idata->bits[x+y*idata->w] = PM_RGB(r, g, b);
+    int *t = tm->heap;
+    tm->heap = tm->next;
+    tm->next = t;
+    t = tm->heap_mark;
+    tm->heap_mark = tm->next_mark;
+    tm->next_mark = t;
+    tm->heap_size = tm->next_size;
+    tm->next_size = 0;
+
+    for(int i = tm->heap_size / 2 - 1; i >= 0; --i) {
+        siftDown(tm->heap, tm->heap_size, i);
+    }
+}
+
+static void freeTiles(tile_map *tm)
+{
+    free(tm->heap);
+    free(tm->next);
+    free(tm->heap_mark);
+    free(tm->next_mark);
+}
+
+static int allocTiles(tile_map *tm, int w, int h)
+{
+    tm->tiles_x = (w - 2 + PM_TILE - 1) / PM_TILE;
+    tm->tiles_y = (h - 2 + PM_TILE - 1) / PM_TILE;
+    size_t tiles = tm->tiles_x > 0 && tm->tiles_y > 0 ? (size_t)tm->tiles_x * tm->tiles_y : 0;
+    tm->heap = (int *)malloc((tiles + 1) * sizeof(int));
+    tm->next = (int *)malloc((tiles + 1) * sizeof(int));
+    tm->heap_mark = (int *)calloc(tiles + 1, sizeof(int));
+    tm->next_mark = (int *)calloc(tiles + 1, sizeof(int));
+
+    if(!tm->heap || !tm->next || !tm->heap_mark || !tm->next_mark) {
+        freeTiles(tm);
+        return -1;
+    }
+
+    /* первая итерация обрабатывает все плитки; возрастающий массив - куча */
+    for(size_t t = 0; t < tiles; ++t) {
+        tm->heap[t] = (int)t;
+        tm->heap_mark[t] = 1;
+    }
+
+    tm->heap_size = (int)tiles;
+    tm->next_size = 0;
+    return 0;
+}
+
+/*!
+ * \brief Обработка плитки на месте
+ * \return максимальное изменение канала (0 - плитка не изменилась)
+ */
+static int applyTile(img_data *idata, const float *lut, const tile_map *tm, int tile)
+{
+    const int x0 = 1 + (tile % tm->tiles_x) * PM_TILE;
+    const int y0 = 1 + (tile / tm->tiles_x) * PM_TILE;
+    const int x1 = x0 + PM_TILE < idata->w - 1 ? x0 + PM_TILE : idata->w - 1;
+    const int y1 = y0 + PM_TILE < idata->h - 1 ? y0 + PM_TILE : idata->h - 1;
+    int change = 0;
+
+    for(int y = y0; y < y1; ++y) {
+        for(int x = x0; x < x1; ++x) {
+            uint old = idata->bits[x+y*idata->w];
+            int r = applyChannel(idata, lut, x, y, 0);
+            int g = applyChannel(idata, lut, x, y, 1);
+            int b = applyChannel(idata, lut, x, y, 2);
+            uint rgb = PM_RGB(r, g, b);
+            idata->bits[x+y*idata->w] = rgb;
+
+            if(rgb != old) {
+                for(int ch = 0; ch < 3; ++ch) {
+                    int d = abs(getChannel(rgb, ch) - getChannel(old, ch));
+                    change = d > change ? d : change;
+                }
             }
         }
     }
+
+    return change;
+}
+
+/*
+ * Пиксели обновляются на месте, поэтому пиксель читает новые значения
+ * соседей сверху и слева и старые - снизу и справа. Обход плиток в
+ * порядке строк сохраняет этот порядок, результат совпадает с
+ * попиксельным проходом. Плитка, все входы которой не изменились с её
+ * последнего пересчёта без изменений, не изменится и сейчас, поэтому:
+ *  - изменившаяся плитка пересчитывается на следующей итерации вместе
+ *    с соседями сверху и слева (они уже пройдены);
+ *  - соседи снизу и справа ещё не пройдены и пересчитываются на текущей.
+ */
+int pm(img_data *idata, proc_data *pdata)
+{
+    float local_lut[PM_LUT_SIZE];
+    const float *lut = pdata->lut;
+    tile_map tm;
+
+    if(!lut) {
+        pm_lut_init(local_lut, pdata);
+        lut = local_lut;
+    }
+
+    if(allocTiles(&tm, idata->w, idata->h)) {
+        return -1;
+    }
+
+    const int tiles = tm.tiles_x * tm.tiles_y;
+    int it = 0;
+
+    while(it < pdata->iterations && tm.heap_size > 0) {
+        int change = 0;   /* максимальное изменение канала за итерацию */
+        int active = 0;
+
+        /* метки: it + 1 - текущая итерация, it + 2 - следующая */
+        while(tm.heap_size > 0) {
+            int t = heapPop(&tm);
+            int d = applyTile(idata, lut, &tm, t);
+            change = d > change ? d : change;
+            ++active;
+
+            if(d > 0) {
+                const int tx = t % tm.tiles_x, ty = t / tm.tiles_x;
+
+                if(tx + 1 < tm.tiles_x) heapPush(&tm, t + 1, it + 1);
+
+                if(ty + 1 < tm.tiles_y) heapPush(&tm, t + tm.tiles_x, it + 1);
+
+                nextPush(&tm, t, it + 2);
+
+                if(tx > 0) nextPush(&tm, t - 1, it + 2);
+
+                if(ty > 0) nextPush(&tm, t - tm.tiles_x, it + 2);
+            }
+        }
+
+        if(pdata->active) {
+            pdata->active[it] = (float)active / tiles;
+        }
+
+        nextIteration(&tm);
+        ++it;
+
+        if(change < pdata->epsilon) {
+            break;
+        }
+    }
+
+    freeTiles(&tm);
+    return it;
+}
+
+int pm_row(const uint *up, uint *row, const uint *down, int w, const float *lut)
+{
+    int change = 0;
+
+    for(int x = 1; x < w - 1; ++x) {
+        const uint old = row[x];
+        int v[3];
+
+        for(int ch = 0; ch < 3; ++ch) {
+            /* порядок суммы как в applyChannel: x-1, x+1, y+1, y-1 */
+            int p = getChannel(old, ch);
+            int deltaW = getChannel(up[x], ch) - p;
+            int deltaE = getChannel(down[x], ch) - p;
+            int deltaS = getChannel(row[x+1], ch) - p;
+            int deltaN = getChannel(row[x-1], ch) - p;
+            v[ch] = p + (lut[deltaN + PM_LUT_OFFSET] + lut[deltaS + PM_LUT_OFFSET] +
+                         lut[deltaE + PM_LUT_OFFSET] + lut[deltaW + PM_LUT_OFFSET]);
+        }
+
+        const uint rgb = PM_RGB(v[0], v[1], v[2]);
+        row[x] = rgb;
+
+        for(int ch = 0; ch < 3; ++ch) {
+            int d = abs(getChannel(rgb, ch) - getChannel(old, ch));
+            change = d > change ? d : change;
+        }
+    }
+
+    return change;
+}
+
+int pm_rows(const img_data *src, uint *dst, const float *lut, int y0, int y1)
+{
+    const int w = src->w;
+    int change = 0;
+
+    for(int y = y0; y < y1; ++y) {
+        const uint *in = src->bits + (size_t)y * w;
+        uint *out = dst + (size_t)y * w;
+
+        if(y == 0 || y == src->h - 1) {
+            for(int x = 0; x < w; ++x) out[x] = in[x];
+
+            continue;
+        }
+
+        out[0] = in[0];
+        out[w - 1] = in[w - 1];
+
+        for(int x = 1; x < w - 1; ++x) {
+            int r = applyChannel(src, lut, x, y, 0);
+            int g = applyChannel(src, lut, x, y, 1);
+            int b = applyChannel(src, lut, x, y, 2);
+            uint rgb = PM_RGB(r, g, b);
+            out[x] = rgb;
+
+            for(int ch = 0; ch < 3; ++ch) {
+                int d = abs(getChannel(rgb, ch) - getChannel(in[x], ch));
+                change = d > change ? d : change;
+            }
+        }
+    }
+
+    return change;
 }
 
 float pm_quadric(int norm, float thresh)
@@ -65,4 +336,13 @@ float pm_quadric(int norm, float thresh)
 float pm_exponential(int norm, float thresh)
 {
     return exp(- norm * norm / (thresh * thresh));
+}
+
+void pm_lut_init(float *lut, const proc_data *pdata)
+{
+    for(int d = -PM_LUT_OFFSET; d <= PM_LUT_OFFSET; ++d) {
+        float c = pdata->conduction_func ? pm_exponential(abs(d), pdata->thresh)
+                                         : pm_quadric(abs(d), pdata->thresh);
+        lut[d + PM_LUT_OFFSET] = pdata->lambda * c * d;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,339 @@
+/*!
+  \file
+  \brief Многопоточная реализация фильтра Перона-Малика на CPU
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "pm_cpu.hpp"
+
+extern "C" {
+#include "pm_planar.h" // planar_data
+#include "pm_simd.h"   // pm_simd_name
+}
+
+#include <iostream>
+#include <iomanip>      // setprecision
+#include <chrono>       // steady_clock
+#include <cstring>      // memcpy
+#include <algorithm>    // std::min, std::max
+#include <stdexcept>    // std::runtime_error
+#include <vector>
+
+/*!
+ * \brief Окно в плоскостях буфера: начало координат и шаг строки
+ */
+struct PlaneView {
+    float *p[PM_PLANES];
+    int stride;
+};
+
+static PlaneView viewOf(const planar_data &pd, int buf, int x, int y)
+{
+    PlaneView v;
+
+    for(int ch = 0; ch < PM_PLANES; ++ch) {
+        v.p[ch] = pm_planar_plane(&pd, buf, ch) + (size_t)y * pd.w + x;
+    }
+
+    v.stride = pd.w;
+    return v;
+}
+
+/*!
+ * \brief Одна итерация для прямоугольника [x0, x1) x [y0, y1) окна in в окно out
+ * \return максимальное изменение канала
+ */
+static float stepRect(const planar_data &pd, const PlaneView &in, const PlaneView &out,
+                      int x0, int y0, int x1, int y1)
+{
+    float change = 0.0f;
+
+    if(x0 >= x1) return change;
+
+    for(int ch = 0; ch < PM_PLANES; ++ch) {
+        for(int y = y0; y < y1; ++y) {
+            const float *c = in.p[ch] + (size_t)y * in.stride;
+            change = std::max(change, pd.row(c - in.stride, c, c + in.stride,
+                                             out.p[ch] + (size_t)y * out.stride,
+                                             x0, x1, pd.coef));
+        }
+    }
+
+    return change;
+}
+
+/*!
+ * \brief Изменения, найденные потоками на проходе; два набора по чётности
+ *        прохода, чтобы поток мог начать следующий проход, пока остальные
+ *        ещё читают результаты текущего
+ */
+class ChangeSlots
+{
+public:
+    explicit ChangeSlots(int threads) : slots{std::vector<float>(threads), std::vector<float>(threads)} {}
+    void set(int pass, int idx, float change)
+    {
+        slots[pass & 1][idx] = change;
+    }
+    /*!
+     * \brief Максимум по потокам (вызывать после барьера)
+     */
+    float max(int pass) const
+    {
+        const std::vector<float> &v = slots[pass & 1];
+        return *std::max_element(v.begin(), v.end());
+    }
+private:
+    std::vector<float> slots[2];
+};
+
+/*!
+ * \brief Скопировать прямоугольник [x0, x1) x [y0, y1) окна in в окно out
+ */
+static void copyRect(const PlaneView &in, const PlaneView &out, int x0, int y0, int x1, int y1)
+{
+    for(int ch = 0; ch < PM_PLANES; ++ch) {
+        for(int y = y0; y < y1; ++y) {
+            memcpy(out.p[ch] + (size_t)y * out.stride + x0,
+                   in.p[ch] + (size_t)y * in.stride + x0, (x1 - x0) * sizeof(float));
+        }
+    }
+}
+
+/*!
+ * \brief Итерации по горизонтальным полосам, по одной на поток
+ * \return кол-во выполненных итераций
+ */
+static int runBands(planar_data &pd, proc_data *pdata, ThreadPool &pool)
+{
+    const int bands = pool.size();
+    const int rows = pd.h - 2;  /* внутренние строки [1, h-1) */
+    ChangeSlots changes(bands);
+    int performed = 0;
+
+    pool.run([&](int idx) {
+        /* полоса строк этого потока, собственная копия индекса источника */
+        const int y0 = 1 + (int)((long long)rows * idx / bands);
+        const int y1 = 1 + (int)((long long)rows * (idx + 1) / bands);
+        planar_data local = pd;
+        int it = 0;
+
+        while(it < pdata->iterations) {
+            changes.set(it, idx, pm_planar_rows(&local, y0, y1));
+            pm_planar_swap(&local);
+            /* следующая итерация читает строки соседних полос */
+            pool.barrier();
+
+            /* все потоки видят один и тот же максимум и выходят вместе */
+            if(changes.max(it++) < pdata->epsilon) {
+                break;
+            }
+        }
+
+        if(idx == 0) {
+            pd.src = local.src;
+            performed = it;
+        }
+    });
+
+    return performed;
+}
+
+/*!
+ * \brief Временное блокирование: плитка tile_w x tile_h с ореолом k
+ *        продвигается на k итераций (перекрывающиеся трапеции).
+ *        Первый шаг читает изображение, промежуточные шаги выполняются
+ *        в буфере потока (кэш), последний пишет плитку в изображение.
+ *        Изображение читается из памяти ~iterations/k раз вместо iterations.
+ * \note граница изображения не изменяется фильтром, поэтому ореол у неё
+ *       не нужен; ошибки на краю ореола распространяются на 1 px за итерацию
+ *       и не достигают плитки, результат совпадает с runBands побитово
+ * \note сходимость проверяется после каждого прохода (k итераций)
+ * \return кол-во выполненных итераций
+ */
+static int runTiles(planar_data &pd, proc_data *pdata, ThreadPool &pool,
+                     int tile_w, int tile_h, int k)
+{
+    const int tiles_x = (pd.w + tile_w - 1) / tile_w;
+    const int tiles_y = (pd.h + tile_h - 1) / tile_h;
+    const int tiles = tiles_x * tiles_y;
+    std::vector<planar_data> scratch(pool.size());
+    ChangeSlots changes(pool.size());
+    int performed = 0;
+
+    for(auto &sd : scratch) {
+        if(pm_planar_alloc(&sd, tile_w + 2 * k, tile_h + 2 * k)) {
+            for(auto &s : scratch) pm_planar_free(&s);
+
+            throw std::runtime_error("Not enough memory for tile buffers!");
+        }
+    }
+
+    pool.run([&](int idx) {
+        planar_data local = pd;
+        planar_data &sd = scratch[idx];
+        int it = 0;
+
+        for(int pass = 0; it < pdata->iterations; ++pass) {
+            const int steps = std::min(k, pdata->iterations - it);
+            float change = 0.0f;
+
+            for(int t = idx; t < tiles; t += pool.size()) {
+                const int tx0 = (t % tiles_x) * tile_w, tx1 = std::min(tx0 + tile_w, pd.w);
+                const int ty0 = (t / tiles_x) * tile_h, ty1 = std::min(ty0 + tile_h, pd.h);
+                /* плитка с ореолом, усечённая по границе изображения */
+                const int rx0 = std::max(tx0 - steps, 0), rx1 = std::min(tx1 + steps, pd.w);
+                const int ry0 = std::max(ty0 - steps, 0), ry1 = std::min(ty1 + steps, pd.h);
+                const int rw = rx1 - rx0, rh = ry1 - ry0;
+                /* окна в координатах ореола */
+                const PlaneView src = viewOf(local, local.src, rx0, ry0);
+                const PlaneView dst = viewOf(local, local.src ^ 1, rx0, ry0);
+                PlaneView tmp[2] = { viewOf(sd, 0, 0, 0), viewOf(sd, 1, 0, 0) };
+                tmp[0].stride = tmp[1].stride = rw;
+
+                /* граница изображения читается, но не пересчитывается */
+                for(int b = 0; b < 2 && steps > 1; ++b) {
+                    if(ry0 == 0)      copyRect(src, tmp[b], 0, 0, rw, 1);
+
+                    if(ry1 == pd.h)   copyRect(src, tmp[b], 0, rh - 1, rw, rh);
+
+                    if(rx0 == 0)      copyRect(src, tmp[b], 0, 0, 1, rh);
+
+                    if(rx1 == pd.w)   copyRect(src, tmp[b], rw - 1, 0, rw, rh);
+                }
+
+                for(int s = 1; s <= steps; ++s) {
+                    /* трапеция: на шаге s нужна область плитка + (steps - s) */
+                    const int e = steps - s;
+                    const PlaneView &in = s == 1 ? src : tmp[s & 1];
+                    const PlaneView &out = s == steps ? dst : tmp[(s + 1) & 1];
+                    float d = stepRect(local, in, out,
+                                       std::max(tx0 - e, 1) - rx0, std::max(ty0 - e, 1) - ry0,
+                                       std::min(tx1 + e, pd.w - 1) - rx0, std::min(ty1 + e, pd.h - 1) - ry0);
+
+                    /* на последнем шаге пересчитывается ровно плитка */
+                    if(s == steps) {
+                        change = std::max(change, d);
+                    }
+                }
+            }
+
+            changes.set(pass, idx, change);
+            pm_planar_swap(&local);
+            it += steps;
+            /* следующий проход читает ореолы соседних плиток */
+            pool.barrier();
+
+            if(changes.max(pass) < pdata->epsilon) {
+                break;
+            }
+        }
+
+        if(idx == 0) {
+            pd.src = local.src;
+            performed = it;
+        }
+    });
+
+    for(auto &sd : scratch) {
+        pm_planar_free(&sd);
+    }
+
+    return performed;
+}
+
+/*!
+ * \brief Оценка объёма данных, проходящих через память (байт): модель
+ *        по числу чтений и записей плоскостей, не измерение
+ */
+static double trafficBands(int w, int h, int iterations)
+{
+    /* чтение и запись всех плоскостей на каждой итерации */
+    return 2.0 * iterations * w * h * PM_PLANES * sizeof(float);
+}
+
+static double trafficTiles(int w, int h, int iterations, int tile_w, int tile_h, int k)
+{
+    double bytes = 0.0;
+
+    for(int it = 0; it < iterations; it += k) {
+        const int steps = std::min(k, iterations - it);
+
+        for(int ty0 = 0; ty0 < h; ty0 += tile_h) {
+            const int ty1 = std::min(ty0 + tile_h, h);
+            const int rh = std::min(ty1 + steps, h) - std::max(ty0 - steps, 0);
+
+            for(int tx0 = 0; tx0 < w; tx0 += tile_w) {
+                const int tx1 = std::min(tx0 + tile_w, w);
+                const int rw = std::min(tx1 + steps, w) - std::max(tx0 - steps, 0);
+                /* чтение плитки с ореолом, запись плитки */
+                bytes += ((double)rw * rh + (double)(tx1 - tx0) * (ty1 - ty0)) *
+                         PM_PLANES * sizeof(float);
+            }
+        }
+    }
+
+    return bytes;
+}
+
+int pm_cpu(img_data *idata, proc_data *pdata, cpu_data *cdata)
+{
+    planar_data pd;
+
+    if(pm_planar_alloc(&pd, idata->w, idata->h)) {
+        throw std::runtime_error("Not enough memory for planar buffers!");
+    }
+
+    pm_planar_setup(&pd, pdata, cdata->isa);
+    pm_planar_unpack(&pd, idata);
+    ThreadPool &pool = *cdata->pool;
+    const bool tiled = cdata->tile_w > 0 && cdata->tile_h > 0 && cdata->tile_iterations > 0;
+
+    if(cdata->verbose) {
+        std::cout << "cpu threads: " << pool.size() << std::endl;
+        std::cout << "cpu instruction set: " << pm_simd_name(cdata->isa) << std::endl;
+
+        if(tiled) {
+            std::cout << "cpu tile size: " << cdata->tile_w << "x" << cdata->tile_h
+                      << ", iterations per tile: "
+                      << cdata->tile_iterations << std::endl;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int iterations;
+
+    try
+    {
+        if(tiled) {
+            iterations = runTiles(pd, pdata, pool, cdata->tile_w, cdata->tile_h,
+                                  cdata->tile_iterations);
+        } else {
+            iterations = runBands(pd, pdata, pool);
+        }
+    } catch(...) {
+        pm_planar_free(&pd);
+        throw;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(cdata->profile) {
+        /* оценка по модели: объём данных через память и пропускная способность */
+        double untiled = trafficBands(pd.w, pd.h, iterations);
+        double traffic = tiled ? trafficTiles(pd.w, pd.h, iterations,
+                                              cdata->tile_w, cdata->tile_h,
+                                              cdata->tile_iterations) : untiled;
+        std::cout << std::fixed << std::setprecision(3)
+                  << "cpu estimated memory traffic = " << traffic / 1048576.0 << " MB ("
+                  << (untiled / 1048576.0) << " MB untiled, estimated saving x"
+                  << std::setprecision(2) << untiled / traffic << ")" << std::endl
+                  << "cpu effective bandwidth (estimated untiled traffic / time) = " << std::setprecision(3)
+                  << (seconds > 0.0 ? untiled / seconds / 1073741824.0 : 0.0) << " GB/s" << std::endl;
+    }
+
+    pm_planar_pack(&pd, idata);
+    pm_planar_free(&pd);
+    return iterations;
+}
@@ -0,0 +1,163 @@
+/*!
+  \file
+  \brief Совместное выполнение фильтра Перона-Малика на CPU и устройстве OpenCL
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "pm_hetero.hpp"
+
+#include <iostream>
+#include <iomanip>      // setprecision
+#include <chrono>       // steady_clock
+#include <cstring>      // memcpy
+#include <cstdlib>      // std::abs
+#include <algorithm>    // std::min, std::max, std::copy
+#include <vector>
+
+/*!
+ * \brief Итераций между перераспределениями строк
+ */
+#define PM_HETERO_PERIOD 2
+
+typedef std::chrono::steady_clock hetero_clock;
+
+static double secondsSince(const hetero_clock::time_point &start)
+{
+    return std::chrono::duration<double>(hetero_clock::now() - start).count();
+}
+
+int pm_hetero(img_data *idata, proc_data *pdata, cl_data *cdata, ThreadPool *pool)
+{
+    /* размер полосы устройства меняется, размер изображения в программу не встраивается */
+    cl_data cd = *cdata;
+    cd.specialize = std::min(cd.specialize, 1);
+    PMSession session(cd);
+    const int workers = pool->size() - 1;
+    const int w = idata->w, h = idata->h;
+
+    if(workers < 1 || h < 3) {
+        return session.run(idata, pdata);
+    }
+
+    float table[PM_LUT_SIZE];
+    const float *lut = pdata->lut;
+
+    if(!lut) {
+        pm_lut_init(table, pdata);
+        lut = table;
+    }
+
+    /* два буфера хоста: текущая итерация и следующая */
+    std::vector<uint> buffer(idata->bits, idata->bits + idata->size);
+    uint *cur = idata->bits, *next = buffer.data();
+    /* строки [0, split) - устройство, [split, h) - CPU */
+    int split = h / 2;
+    session.begin(idata, pdata);
+    session.setRows(split + 1);
+
+    if(cdata->verbose) {
+        std::cout << "co-execution: opencl device + " << workers << " cpu threads" << std::endl;
+    }
+
+    auto start = hetero_clock::now();
+    const bool converge = pdata->epsilon > 0.0f;
+    std::vector<double> finish(pool->size());
+    std::vector<int> changes(pool->size());
+    double dev_time = 0.0, cpu_time = 0.0;
+    int since = 0;
+    int it = 0;
+
+    while(it < pdata->iterations) {
+        session.iterate(1, converge);
+        const img_data view = { cur, idata->size, w, h };
+        auto launch = hetero_clock::now();
+
+        pool->run([&](int idx) {
+            if(idx == 0) {
+                session.wait();
+            } else {
+                const int rows = h - split;
+                const int y0 = split + (int)((long long)rows * (idx - 1) / workers);
+                const int y1 = split + (int)((long long)rows * idx / workers);
+                changes[idx] = pm_rows(&view, next, lut, y0, y1);
+            }
+
+            finish[idx] = secondsSince(launch);
+        });
+
+        /* граничные строки: последняя строка устройства и первая строка CPU */
+        session.readRows(split - 1, 1, next + (size_t)(split - 1) * w);
+        session.writeRows(split, 1, next + (size_t)split * w);
+        std::swap(cur, next);
+        ++it;
+
+        dev_time += finish[0];
+        cpu_time += *std::max_element(finish.begin() + 1, finish.end());
+
+        if(converge) {
+            cl_uint change = session.lastChange();
+
+            for(int idx = 1; idx < pool->size(); ++idx) {
+                change = std::max(change, (cl_uint)changes[idx]);
+            }
+
+            if(change < pdata->epsilon) {
+                break;
+            }
+        }
+
+        if(++since < PM_HETERO_PERIOD || it == pdata->iterations) {
+            continue;
+        }
+
+        /* граница к равному времени итерации, с шагом в половину разницы */
+        const double dev_rate = split / std::max(dev_time, 1e-9);
+        const double cpu_rate = (h - split) / std::max(cpu_time, 1e-9);
+        const int target = (int)(h * dev_rate / (dev_rate + cpu_rate) + 0.5);
+        const int moved = std::min(std::max(split + (target - split) / 2, 1), h - 1);
+        dev_time = cpu_time = 0.0;
+        since = 0;
+
+        if(std::abs(moved - split) < std::max(h / 100, 1)) {
+            continue;
+        }
+
+        if(moved > split) {
+            /* строки [split, moved) и новая граничная строка - на устройство */
+            session.writeRows(split, moved + 1 - split, cur + (size_t)split * w);
+        } else {
+            /* строки [moved, split) и новая граничная строка - на хост */
+            session.readRows(moved - 1, split + 1 - moved, cur + (size_t)(moved - 1) * w);
+            session.wait();
+        }
+
+        split = moved;
+        session.setRows(split + 1);
+
+        if(cdata->verbose) {
+            std::cout << "co-execution: iteration " << it << ", device rows 0-" << split
+                      << ", cpu rows " << split << "-" << h << std::endl;
+        }
+    }
+
+    /* строки устройства на место */
+    session.readRows(0, split, cur);
+    session.wait();
+
+    if(cur != idata->bits) {
+        memcpy(idata->bits, cur, idata->size * sizeof(uint));
+    }
+
+    if(cdata->verbose) {
+        std::cout << "co-execution: device share " << std::fixed << std::setprecision(1)
+                  << (split * 100.0 / h) << "%" << std::endl;
+    }
+
+    if(cdata->profile) {
+        std::cout << "co-execution time in milliseconds = " << std::fixed
+                  << std::setprecision(3) << (secondsSince(start) * 1000.0) << " ms" << std::endl;
+    }
+
+    return it;
+}
@@ -11,21 +11,283 @@
 #include <fstream>      // ifstream
 #include <sstream>      // stringstream
 #include <iomanip>      // setprecision
-#include <cmath>        // ceil
 #include <stdexcept>    // std::runtime_error, std::invalid_argument
-#include <algorithm>	// std::min
+#include <algorithm>	// std::min, std::max, std::copy, std::equal, std::all_of
+#include <chrono>       // steady_clock
+#include <cstdio>       // std::rename, std::remove, snprintf
+#include <memory>       // std::unique_ptr
+#include <cstring>      // memcpy
+#include <cmath>        // std::sqrt, std::isfinite
+#include <climits>      // INT_MAX
 
-#define __CL_ENABLE_EXCEPTIONS
+#include <random>       // std::random_device
 
-#if defined(__APPLE__) || defined(__MACOSX)
-    #include "cl.hpp"
+#if defined(_WIN32)
+    #include <direct.h>     // _mkdir
+    #include <process.h>    // _getpid
 #else
-    #include <CL/cl.hpp>
+    #include <sys/stat.h>   // mkdir, fchmod
+    #include <unistd.h>     // close
+    #include <stdlib.h>     // mkstemp
 #endif
 
-void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
+PMSession::PMSession(const cl_data &cdata)
+    : PMSession(cdata, cl::Device())
+{
+}
+
+PMSession::PMSession(const cl_data &cdata, const cl::Device &dev)
+    : cdata(cdata)
+    , use_image(false)
+    , vec_width(4)
+    , image_support(false)
+    , bits_capacity(0)
+    , image_w(0)
+    , image_h(0)
+    , lut_valid(false)
+    , step_w(0)
+    , step_src(0)
+    , step_global_x(0)
+    , step_global_y(0)
+    , rgb_capacity(0)
+{
+    if(dev()) {
+        device = dev;
+        platform = cl::Platform(dev.getInfo<CL_DEVICE_PLATFORM>());
+    } else {
+        selectDevice();
+    }
+
+    std::vector<cl::Device> ds { device };
+    /* создать контекст */
+    context = cl::Context(ds, NULL, NULL, NULL);
+    /* создать команду */
+    queue = cl::CommandQueue(context, device, (cdata.profile ? CL_QUEUE_PROFILING_ENABLE : 0));
+
+    /* бинарная программа собрана с PM_VEC_WIDTH по умолчанию */
+    if(!cdata.bitcode) {
+        vec_width = vectorWidth();
+    }
+
+    build_options = "-D PM_VEC_WIDTH=" + std::to_string(vec_width);
+    buildProgram(build_options);
+    /* создать ядро: результат tune() или выбор по свойствам устройства */
+    selectKernel();
+    use_image = image_support && variant.steps == 1 && variant.width == 1;
+    const bool tuned = loadTuning();
+    builds[build_options] = Build { program, variant, image_variant, use_image };
+    lut = cl::Buffer(context, CL_MEM_READ_ONLY, PM_LUT_SIZE * sizeof(float));
+    change = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+    if(cdata.verbose) {
+        std::string pname, dname;
+        platform.getInfo(CL_PLATFORM_NAME, &pname);
+        device.getInfo(CL_DEVICE_NAME, &dname);
+        std::cout << "selected platform: " << pname << std::endl;
+        std::cout << "selected device: "   << dname << std::endl;
+        const Variant &v = use_image ? image_variant : variant;
+
+        if(tuned) {
+            std::cout << "tuning loaded: " << tunePath() << std::endl;
+        }
+
+        std::cout << "kernel: " << v.kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << std::endl;
+        std::cout << "work group size: " << v.local_x << ", " << v.local_y << std::endl;
+
+        if(v.width > 1) {
+            std::cout << "pixels per work item: " << v.width << std::endl;
+        }
+    }
+}
+
+static size_t floorPow2(size_t v)
+{
+    size_t p = 1;
+
+    while(p * 2 <= v) {
+        p *= 2;
+    }
+
+    return p;
+}
+
+/*!
+ * \brief Допустимый размер рабочей группы: не больше CL_KERNEL_WORK_GROUP_SIZE
+ *        и CL_DEVICE_MAX_WORK_ITEM_SIZES, строка группы - до 32 элементов
+ *        (смежные адреса), всего до 256 элементов
+ */
+void PMSession::localSize(const cl::Kernel &k, size_t &lx, size_t &ly) const
+{
+    size_t max_group = k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    const size_t target = floorPow2(std::max<size_t>(std::min<size_t>(max_group, 256), 1));
+    lx = std::min(std::min<size_t>(32, target), floorPow2(max_items[0]));
+    ly = std::min(floorPow2(target / lx), floorPow2(max_items[1]));
+}
+
+#define PM_MAX_STEPS 16  /* максимум итераций за запуск pm_temporal */
+
+/*!
+ * \brief Выбор варианта ядра при выделенной локальной памяти (CL_LOCAL):
+ *        pm_temporal с наибольшим числом итераций за запуск, при котором
+ *        две плитки с ореолом помещаются в локальную память, а плитка
+ *        не больше 4 площадей группы (избыточные вычисления ореола);
+ *        pm_local, если помещается плитка с ореолом 1 px; иначе pm
+ * \note на CPU локальная память эмулируется глобальной (CL_GLOBAL),
+ *       копирование плитки там только добавляет работу; используется
+ *       pm_vec (vec_width пикселей на рабочий элемент)
+ * \note при поддержке изображений готовится и pm_image, он используется
+ *       вместо pm/pm_local (use_image), если изображение помещается в image2d_t
+ */
+void PMSession::selectKernel()
+{
+    image_support = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+    size_t lx, ly;
+
+    if(image_support) {
+        localSize(cl::Kernel(program, "pm_image"), lx, ly);
+        makeVariant("pm_image", lx, ly, 1, image_variant);
+    }
+
+    if(device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() != CL_LOCAL) {
+        /* CPU: несколько пикселей на рабочий элемент векторами */
+        localSize(cl::Kernel(program, "pm_vec"), lx, ly);
+        makeVariant("pm_vec", lx, ly, 1, variant);
+        return;
+    }
+
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    localSize(cl::Kernel(program, "pm_temporal"), lx, ly);
+
+    /* квадратная группа - наименьший ореол на пиксель */
+    while(lx > ly && ly * 2 <= max_items[1]) {
+        lx /= 2;
+        ly *= 2;
+    }
+
+    for(int k = PM_MAX_STEPS; k >= 2; --k) {
+        const size_t tile = (lx + 2 * k) * (ly + 2 * k);
+
+        if(tile <= 4 * lx * ly && makeVariant("pm_temporal", lx, ly, k, variant)) {
+            return;
+        }
+    }
+
+    localSize(cl::Kernel(program, "pm_local"), lx, ly);
+
+    if(makeVariant("pm_local", lx, ly, 1, variant)) {
+        return;
+    }
+
+    localSize(cl::Kernel(program, "pm"), lx, ly);
+    makeVariant("pm", lx, ly, 1, variant);
+}
+
+/*!
+ * \brief Вариант ядра name с группой lx x ly
+ * \param steps - итераций за запуск (только pm_temporal)
+ * \return false, если группа или локальная память превышают ограничения
+ *         устройства и ядра, или ядро неизвестно
+ * \throws cl::Error - ядра нет в программе
+ */
+bool PMSession::makeVariant(const std::string &name, size_t lx, size_t ly, int steps, Variant &v) const
+{
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    v.kernel = cl::Kernel(program, name.c_str());
+    v.local_x = lx;
+    v.local_y = ly;
+    v.local_bytes = 0;
+    v.steps = 1;
+    v.width = 1;
+    v.image = false;
+
+    if(lx == 0 || ly == 0 || lx > max_items[0] || ly > max_items[1] ||
+       lx * ly > v.kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) {
+        return false;
+    }
+
+    if(name == "pm_local") {
+        v.local_bytes = (lx + 2) * (ly + 2) * sizeof(cl_uchar4);
+    } else if(name == "pm_temporal") {
+        if(steps < 2 || steps > PM_MAX_STEPS) {
+            return false;
+        }
+
+        v.steps = steps;
+        v.local_bytes = 2 * (lx + 2 * steps) * (ly + 2 * steps) * sizeof(cl_uchar4);
+    } else if(name == "pm_vec") {
+        v.width = vec_width;
+    } else if(name == "pm_image") {
+        v.image = true;
+    } else if(name != "pm") {
+        return false;
+    }
+
+    const cl_ulong local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    return v.local_bytes + v.kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device) <= local_mem;
+}
+
+/*!
+ * \brief Ширина вектора pm_vec по CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT:
+ *        8 для AVX/AVX2, иначе 4 (SSE, NEON)
+ */
+int PMSession::vectorWidth() const
+{
+    return device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT>() >= 8 ? 8 : 4;
+}
+
+/*!
+ * \brief Суммарное время выполнения команд (нс)
+ */
+static double eventsTime(const std::vector<cl::Event> &events)
+{
+    double total = 0.0;
+
+    for(auto &event : events) {
+        cl_ulong time_start, time_end;
+        event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
+        event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+        total += (time_end - time_start);
+    }
+
+    return total;
+}
+
+/*!
+ * \brief Время итерации pm_local (нс) для оценки выигрыша pm_temporal
+ * \note буферы bits используются как рабочие, результат должен быть выгружен
+ */
+double PMSession::singleStepTime(const img_data *idata, int iterations)
+{
+    cl::Kernel base(program, "pm_local");
+    size_t lx, ly;
+    localSize(base, lx, ly);
+    base.setArg(2, lut);
+    base.setArg(3, change);
+    base.setArg(4, idata->w);
+    base.setArg(5, idata->h);
+    base.setArg(6, cl::Local((lx + 2) * (ly + 2) * sizeof(cl_uchar4)));
+    std::vector<cl::Event> events(std::max(std::min(iterations, 4), 1));
+
+    for(size_t i = 0; i < events.size(); ++i) {
+        base.setArg(0, bits[i & 1]);
+        base.setArg(1, bits[(i & 1) ^ 1]);
+        queue.enqueueNDRangeKernel(base, cl::NullRange,
+                                   cl::NDRange((idata->w + lx - 1) / lx * lx, (idata->h + ly - 1) / ly * ly),
+                                   cl::NDRange(lx, ly), NULL, &events[i]);
+    }
+
+    queue.finish();
+    return eventsTime(events) / events.size();
+}
+
+const cl::Device &PMSession::getDevice() const
+{
+    return device;
+}
+
+void PMSession::selectDevice()
 {
-    cl_int err = CL_SUCCESS;
     /* получить доступные платформы */
     std::vector<cl::Platform> platforms;
     cl::Platform::get(&platforms);
@@ -35,10 +297,8 @@ void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
     }
 
     /* выбор активной платформы */
-    cl::Platform platform;
-
-    if(cdata->platformId >= 0 && cdata->platformId < platforms.size()) {
-        platform = platforms[cdata->platformId];
+    if(cdata.platformId >= 0 && cdata.platformId < platforms.size()) {
+        platform = platforms[cdata.platformId];
     } else {
         platform = platforms.front();
     }
@@ -52,10 +312,8 @@ void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
     }
 
     /* выбор активного устройства */
-    cl::Device device;
-
-    if(cdata->deviceId >= 0 && cdata->deviceId < devices.size()) {
-        device = devices[cdata->deviceId];
+    if(cdata.deviceId >= 0 && cdata.deviceId < devices.size()) {
+        device = devices[cdata.deviceId];
     } else {
         std::vector<size_t> max_work_item_size = {0, 0, 0};
         std::vector<size_t> dev_work_item_size;
@@ -67,51 +325,303 @@ void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
             }
         }
     }
+}
+
+/*!
+ * \brief Прочитать файл целиком
+ * \return false - файл не удалось открыть
+ */
+static bool readFile(const std::string &path, std::string &data)
+{
+    std::ifstream in(path, std::ios::binary);
+
+    if(in.fail()) {
+        return false;
+    }
+
+    data.assign((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+    return true;
+}
+
+/*!
+ * \brief Записать файл через временный файл с уникальным именем и
+ *        переименование: другие процессы видят прежний или полностью
+ *        записанный файл, одновременные записи не смешиваются
+ * \return false - запись не удалась, временный файл удалён
+ */
+static bool writeFile(const std::string &path, const char *data, size_t size)
+{
+#if defined(_WIN32)
+    std::random_device rd;
+    const std::string tmp = path + "." + std::to_string(_getpid()) + "." + std::to_string(rd()) + ".tmp";
+#else
+    std::string tmp = path + ".XXXXXX";
+    const int fd = mkstemp(&tmp[0]);
+
+    if(fd < 0) {
+        return false;
+    }
+
+    fchmod(fd, 0644);
+    close(fd);
+#endif
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(data, size);
+    out.close();
+
+    if(out.fail() || std::rename(tmp.c_str(), path.c_str())) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Хэш FNV-1a (64 бит)
+ */
+static unsigned long long fnv1a(const std::string &data, unsigned long long hash)
+{
+    for(unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void makeDir(const std::string &path)
+{
+#if defined(_WIN32)
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+/*!
+ * \brief Поле ключа: хэш данных и разделитель полей
+ */
+static unsigned long long hashField(const std::string &data, unsigned long long hash)
+{
+    return fnv1a(std::string(1, '\0'), fnv1a(data, hash));
+}
+
+/*!
+ * \brief Хэш платформы, устройства и версии драйвера
+ */
+unsigned long long PMSession::deviceHash() const
+{
+    std::string pname, pversion, dname, dversion, driver;
+    platform.getInfo(CL_PLATFORM_NAME, &pname);
+    platform.getInfo(CL_PLATFORM_VERSION, &pversion);
+    device.getInfo(CL_DEVICE_NAME, &dname);
+    device.getInfo(CL_DEVICE_VERSION, &dversion);
+    device.getInfo(CL_DRIVER_VERSION, &driver);
+    unsigned long long hash = 14695981039346656037ULL;
+
+    const std::string *keys[] = { &pname, &pversion, &dname, &dversion, &driver };
+
+    for(const std::string *key : keys) {
+        hash = hashField(*key, hash);
+    }
+
+    return hash;
+}
+
+/*!
+ * \brief Файл в каталоге кэша: <prefix><хэш><ext>
+ */
+static std::string hashPath(const std::string &dir, const char *prefix, unsigned long long hash, const char *ext)
+{
+    std::stringstream ss;
+    ss << dir << "/" << prefix << std::hex << std::setw(16) << std::setfill('0') << hash << ext;
+    return ss.str();
+}
+
+std::string PMSession::cachePath(const std::string &source, const std::string &options) const
+{
+    if(cdata.cache_dir.empty()) {
+        return std::string();
+    }
+
+    /* бинарная программа зависит от устройства, драйвера, опций и исходного кода */
+    const unsigned long long hash = hashField(source, hashField(options, deviceHash()));
+    return hashPath(cdata.cache_dir, "pm_", hash, ".bin");
+}
+
+/*!
+ * \brief Файл настройки устройства (результат tune())
+ * \note зависит от ширины pm_vec: она меняет время варианта
+ */
+std::string PMSession::tunePath() const
+{
+    if(cdata.cache_dir.empty()) {
+        return std::string();
+    }
+
+    const unsigned long long hash = hashField(std::to_string(vec_width), deviceHash());
+    return hashPath(cdata.cache_dir, "tune_", hash, ".txt");
+}
+
+/*!
+ * \brief Загрузить вариант из файла настройки устройства;
+ *        строка файла: <ядро> <группа x> <группа y> <итераций за запуск>
+ * \return false - файла нет или вариант недопустим (другой исходный код ядра)
+ */
+bool PMSession::loadTuning()
+{
+    const std::string path = tunePath();
+    std::string data;
+
+    if(path.empty() || !readFile(path, data)) {
+        return false;
+    }
+
+    std::istringstream in(data);
+    std::string line;
+
+    while(std::getline(in, line)) {
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string name;
+        size_t lx, ly;
+        int steps;
+        Variant v;
+
+        if(!(fields >> name >> lx >> ly >> steps)) {
+            return false;
+        }
+
+        try
+        {
+            if(!makeVariant(name, lx, ly, steps, v)) {
+                return false;
+            }
+        } catch(cl::Error) {
+            return false;   /* ядра нет в программе */
+        }
+
+        if(v.image) {
+            image_variant = v;
+        } else {
+            variant = v;
+        }
+
+        use_image = v.image;
+        return true;
+    }
+
+    return false;
+}
 
+void PMSession::buildFromSource(const std::string &source, const std::string &options)
+{
     std::vector<cl::Device> ds { device };
-    /* создать контекст */
-    cl::Context context(ds, NULL, NULL, NULL);
-    /* создать команду */
-    cl::CommandQueue queue(context, device, (cdata->profile ? CL_QUEUE_PROFILING_ENABLE : 0));
-    cl::Program program;
-
-    if(cdata->bitcode) {
-        /* создать объект программы OpenCL из бит кода */
-        auto binaries = cl::Program::Binaries {
-            std::make_pair<const void *, ::size_t>(cdata->filename.c_str(),
-                                                   cdata->filename.length())
-        };
+    /* создать объект программы OpenCL из исходного текста программы */
+    program = cl::Program(context, source, false);
+
+    /* скомпилировать и слинковать программу */
+    try
+    {
+        program.build(ds, options.c_str());
+    } catch(cl::Error err) {
+        if(err.err() == CL_BUILD_PROGRAM_FAILURE) {
+            std::string build_log;
+            program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &build_log);
+            std::cerr << build_log << std::endl;
+        }
+
+        throw;
+    }
+}
+
+void PMSession::buildProgram(const std::string &options)
+{
+    std::vector<cl::Device> ds { device };
+    auto start = std::chrono::steady_clock::now();
+    std::string binary;
+
+    if(cdata.bitcode) {
+        /* создать объект программы OpenCL из бинарного файла */
+        if(!readFile(cdata.filename, binary)) {
+            throw std::invalid_argument(cdata.filename);
+        }
+
+        auto binaries = cl::Program::Binaries { std::make_pair(binary.data(), binary.size()) };
         program = cl::Program(context, ds, binaries);
+        program.build(ds, options.c_str());
     } else {
         /* загрузить исходный код */
-        std::ifstream in(cdata->filename);
+        std::string source;
+
+        if(!readFile(cdata.filename, source)) {
+            throw std::invalid_argument(cdata.filename);
+        }
+
+        const std::string cache = cachePath(source, options);
+        bool cached = false;
+
+        if(!cache.empty() && readFile(cache, binary)) {
+            try
+            {
+                auto binaries = cl::Program::Binaries { std::make_pair(binary.data(), binary.size()) };
+                program = cl::Program(context, ds, binaries);
+                program.build(ds, options.c_str());
+                cached = true;
+            } catch(cl::Error) {
+                /* повреждённый или несовместимый файл - собрать заново */
+            }
+        }
+
+        if(!cached) {
+            buildFromSource(source, options);
+
+            if(!cache.empty()) {
+                /* сохранить бинарную программу; ошибка записи - только без кэша */
+                std::vector<char *> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+                std::vector< ::size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+                if(!binaries.empty() && binaries.front() && sizes.front()) {
+                    makeDir(cdata.cache_dir);
+                    writeFile(cache, binaries.front(), sizes.front());
+                }
 
-        if(in.fail()) {
-            throw std::invalid_argument(cdata->filename);
+                for(char *b : binaries) {
+                    delete[] b;
+                }
+            }
         }
 
-        std::string source(
-            (std::istreambuf_iterator<char> (in)),
-            std::istreambuf_iterator<char> ());
-        in.close();
-        /* создать объект программы OpenCL из исходного текста программы */
-        program = cl::Program(context, source, false);
+        if(cdata.verbose && !cache.empty()) {
+            std::cout << "program binary cache " << (cached ? "hit: " : "miss: ") << cache << std::endl;
+        }
     }
 
-    /* скомпилировать и слинковать программу */
-    cl_int status = program.build(ds);
+    if(cdata.profile) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "program build time in milliseconds = " << std::fixed
+                  << std::setprecision(3) << (seconds * 1000.0) << " ms" << std::endl;
+    }
+}
 
-    if(status == CL_BUILD_PROGRAM_FAILURE) {
-        std::string build_log;
-        program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &build_log);
-        std::cerr << build_log << std::endl;
+/*!
+ * \brief Буфер изображения не меньше pixels пикселей
+ */
+void PMSession::reserve(size_t pixels)
+{
+    if(pixels <= bits_capacity) {
+        return;
     }
 
     /* получить размер глобальной памяти */
     cl_ulong global_size;
     device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &global_size);
 
-    if(global_size < idata->size * sizeof(uint)) {
+    /* два буфера: источник и приёмник итерации */
+    if(global_size < 2 * pixels * sizeof(uint)) {
         std::stringstream ss;
         std::string dname;
         device.getInfo(CL_DEVICE_NAME, &dname);
@@ -120,64 +630,1372 @@ void pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
         throw std::runtime_error(ss.str());
     }
 
-    /* создать хранилище данных изображения (вход-выход) */
-    cl::Buffer bits(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, idata->size * sizeof(uint), idata->bits);
-    /* создать ядро */
-    cl::Kernel kernel(program, "pm");
-    auto pmKernel = cl::make_kernel<cl::Buffer &, float, int, float, int, int, int, int>(kernel);
-    /* максимальный размер рабочей группы */
-    size_t max_work_group_size;
-    device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &max_work_group_size);
-    size_t work_group_x = std::min((size_t)idata->w, max_work_group_size);
-    size_t work_group_y = std::min((size_t)idata->h, max_work_group_size);
-    cl::NDRange workGroup(work_group_x, work_group_y);
-	cl::EnqueueArgs enqueueArgs(queue, workGroup);
+    for(auto &b : bits) {
+        b = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(uint));
+    }
 
-    if(cdata->verbose) {
-        std::string pname, dname;
-        platform.getInfo(CL_PLATFORM_NAME, &pname);
-        device.getInfo(CL_DEVICE_NAME, &dname);
-        std::cout << "selected platform: " << pname << std::endl;
-        std::cout << "selected device: "   << dname << std::endl;
-        std::cout << "work group size: " << work_group_x << ", " << work_group_y << std::endl;
-        std::cout << "image size: " << idata->w << ", " << idata->h << std::endl;
+    bits_capacity = pixels;
+}
+
+/*!
+ * \brief Изображение помещается в image2d_t устройства
+ */
+bool PMSession::imageFits(int w, int h) const
+{
+    return image_support &&
+           (size_t)w <= device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>() &&
+           (size_t)h <= device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+}
+
+/*!
+ * \brief Изображения image2d_t размером w x h
+ * \note CL_BGRA: байты упакованного 0x00RRGGBB на little-endian,
+ *       загрузка без перепаковки; read_imagef возвращает (r, g, b, a)
+ */
+void PMSession::reserveImages(int w, int h)
+{
+    if(w == image_w && h == image_h) {
+        return;
     }
 
-    double total_time = 0.0;
-    int parts_x = ceil(idata->w / (float)max_work_group_size);
-    int parts_y = ceil(idata->h / (float)max_work_group_size);
-    int offset_x = 0, offset_y = 0;
+    for(auto &image : images) {
+        image = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_BGRA, CL_UNORM_INT8), w, h);
+    }
+
+    image_w = w;
+    image_h = h;
+}
+
+#define PM_MAX_BUILDS 16  /* собранных специализаций в сеансе */
+
+/*!
+ * \brief Опции специализации: загруженная таблица потоков (функция,
+ *        порог, lambda) и, при cdata.specialize > 1, размер изображения
+ *        (idata == nullptr - без размера, например, для тайлов разного размера)
+ * \note значения таблицы - шестнадцатеричные float, без потери точности
+ */
+std::string PMSession::specialization(const img_data *idata) const
+{
+    std::string options = " -D PM_LUT=";
+    char value[32];
+
+    for(int i = 0; i < PM_LUT_SIZE; ++i) {
+        snprintf(value, sizeof(value), "%s%af", i ? "," : "", lut_host[i]);
+        options += value;
+    }
+
+    if(cdata.specialize > 1 && idata) {
+        options += " -D PM_WIDTH=" + std::to_string(idata->w) +
+                   " -D PM_HEIGHT=" + std::to_string(idata->h);
+    }
+
+    return options;
+}
+
+/*!
+ * \brief Перейти на программу, специализированную под параметры
+ *        изображения; собранные программы хранятся по опциям сборки,
+ *        на диске - в кэше бинарных программ
+ * \note таблица потоков должна быть загружена (uploadLut)
+ */
+void PMSession::specialize(const img_data *idata)
+{
+    /* бинарная программа (-b) не пересобирается */
+    if(cdata.specialize <= 0 || cdata.bitcode) {
+        return;
+    }
+
+    /* NaN и бесконечность (например, порог -t 0) не записываются литералами
+       OpenCL C - программа без специализации, таблица остаётся аргументом ядра */
+    const bool finite = std::all_of(lut_host, lut_host + PM_LUT_SIZE, [](float v) {
+        return std::isfinite(v);
+    });
+    const std::string options = "-D PM_VEC_WIDTH=" + std::to_string(vec_width) +
+                                (finite ? specialization(idata) : std::string());
 
-    for(int py = 0; py < parts_y; ++py) {
-        offset_y = py * work_group_y;
+    if(!finite && cdata.verbose) {
+        std::cout << "conduction table is not finite, program is not specialized" << std::endl;
+    }
+
+    if(options == build_options) {
+        return;
+    }
+
+    auto found = builds.find(options);
 
-        for(int px = 0; px < parts_x; ++px) {
-            offset_x = px * work_group_x;
+    if(found == builds.end()) {
+        if(builds.size() >= PM_MAX_BUILDS) {
+            builds.clear();
+        }
 
-			for (int it = 0; it < pdata->iterations; ++it) {
-				/* все очередные операции завершены */
-				queue.finish();
+        buildProgram(options);
+        selectKernel();
+        use_image = image_support && variant.steps == 1 && variant.width == 1;
+        loadTuning();
+        found = builds.insert(std::make_pair(options, Build { program, variant, image_variant, use_image })).first;
 
-				if(cdata->profile) {
-					/* выполнить ядро в режиме профилирования */
-					cl::Event event = pmKernel(enqueueArgs, bits, pdata->thresh, pdata->conduction_func, pdata->lambda, idata->w, idata->h, offset_x, offset_y);
-					/* получить данные профилирования по времени */
-					event.wait();
-					cl_ulong time_start, time_end;
-					event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-					event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
-					total_time += (time_end - time_start);
-				} else {
-					/* выполнить ядро */
-					pmKernel(enqueueArgs, bits, pdata->thresh, pdata->conduction_func, pdata->lambda, idata->w, idata->h, offset_x, offset_y);
-				}
-			}
+        if(cdata.verbose) {
+            std::cout << "specialized program built, " << builds.size() << " in session" << std::endl;
         }
     }
 
-    if(cdata->profile) {
-        /* результат профилирования */
-        std::cout << "parallel execution time in milliseconds = " << std::fixed
-                  << std::setprecision(3) << (total_time / 1000000.0) << " ms" << std::endl;
+    program = found->second.program;
+    variant = found->second.variant;
+    image_variant = found->second.image_variant;
+    use_image = found->second.use_image;
+    build_options = options;
+}
+
+/*!
+ * \brief Загрузить изображение в bits[0] или images[0]
+ */
+void PMSession::upload(const img_data *idata, bool image)
+{
+    if(image) {
+        cl::size_t<3> origin, region;
+        region[0] = idata->w;
+        region[1] = idata->h;
+        region[2] = 1;
+        reserveImages(idata->w, idata->h);
+        queue.enqueueWriteImage(images[0], CL_FALSE, origin, region, 0, 0, idata->bits);
+    } else {
+        reserve(idata->size);
+        queue.enqueueWriteBuffer(bits[0], CL_FALSE, 0, idata->size * sizeof(uint), idata->bits);
+    }
+}
+
+/*!
+ * \brief Аргументы ядра, общие для всех итераций, и глобальный размер:
+ *        всё изображение за один запуск, кратно размеру группы
+ */
+void PMSession::prepare(const Variant &v, const img_data *idata, size_t &global_x, size_t &global_y)
+{
+    cl::Kernel kernel = v.kernel;
+    const size_t items_x = (idata->w + v.width - 1) / v.width;
+    global_x = (items_x + v.local_x - 1) / v.local_x * v.local_x;
+    global_y = (idata->h + v.local_y - 1) / v.local_y * v.local_y;
+    kernel.setArg(2, lut);
+    kernel.setArg(3, change);
+    kernel.setArg(4, idata->w);
+    kernel.setArg(5, idata->h);
+    /* pm_temporal: аргумент 6 - итераций за запуск, плитка - для наибольшего */
+    const int tile_arg = v.steps > 1 ? 7 : 6;
+
+    if(v.local_bytes) {
+        kernel.setArg(tile_arg, cl::Local(v.local_bytes));
+    }
+
+    /* pm_temporal: в изменении учитываются все строки */
+    if(v.steps > 1) {
+        kernel.setArg(8, 0);
+        kernel.setArg(9, idata->h);
+    }
+}
+
+/*!
+ * \brief Загрузить таблицу потоков, если параметры фильтра изменились
+ */
+void PMSession::uploadLut(const proc_data *pdata)
+{
+    float table[PM_LUT_SIZE];
+
+    if(pdata->lut) {
+        std::copy(pdata->lut, pdata->lut + PM_LUT_SIZE, table);
+    } else {
+        pm_lut_init(table, pdata);
+    }
+
+    if(lut_valid && std::equal(table, table + PM_LUT_SIZE, lut_host)) {
+        return;
+    }
+
+    std::copy(table, table + PM_LUT_SIZE, lut_host);
+    queue.enqueueWriteBuffer(lut, CL_TRUE, 0, PM_LUT_SIZE * sizeof(float), lut_host);
+    lut_valid = true;
+}
+
+/*!
+ * \brief Изображение помещается на устройство целиком: буфер не больше
+ *        CL_DEVICE_MAX_MEM_ALLOC_SIZE, два буфера - в глобальной памяти
+ *        и не больше предела тайла cdata.tile_pixels
+ */
+bool PMSession::fitsDevice(size_t pixels) const
+{
+    const cl_ulong bytes = pixels * sizeof(uint);
+    return (!cdata.tile_pixels || pixels <= cdata.tile_pixels) &&
+           bytes <= device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() &&
+           2 * bytes <= device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+}
+
+#define PM_TILE_SETS 2  /* наборы буферов тайла: загрузка следующего во время вычисления текущего */
+
+/*!
+ * \brief Тайл изображения: собственные пиксели и область с ореолом
+ */
+struct OutOfCoreTile {
+    int x0, y0, x1, y1;     ///< собственные пиксели [x0, x1) x [y0, y1)
+    int rx0, ry0, rx1, ry1; ///< область с ореолом, усечённая по границе изображения
+};
+
+/*!
+ * \brief Обработка по частям: тайлы с ореолом шириной в число итераций
+ *        проходят через устройство по очереди. Края тайла для ядра -
+ *        неподвижная граница; ошибка распространяется на 1 px за итерацию
+ *        и не достигает собственных пикселей, результат совпадает с run().
+ *        Два набора буферов: загрузка и выгрузка в отдельной очереди
+ *        идут одновременно с вычислением соседнего тайла.
+ *        Результат пишется в idata->bits на место: очередь передачи
+ *        упорядочена, тайл t+1 загружается до выгрузки тайла t, поэтому
+ *        левый ореол следующего тайла читает исходные пиксели. Нижние k
+ *        строк ряда тайлов - ореол следующего ряда - ждут в полосе хоста
+ *        (две полосы по k строк) до загрузки всех тайлов следующего ряда.
+ * \note ореол не больше тайла (при соседних тайлах)
+ * \note выполняются все итерации, pdata->epsilon не используется
+ */
+int PMSession::runOutOfCore(img_data *idata, proc_data *pdata)
+{
+    const int w = idata->w, h = idata->h;
+    const int k = pdata->iterations;
+    /* область с ореолом: четыре буфера (два набора по два) */
+    cl_ulong limit = std::min(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(),
+                              device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / (2 * PM_TILE_SETS)) / sizeof(uint);
+
+    if(cdata.tile_pixels) {
+        limit = std::min<cl_ulong>(limit, cdata.tile_pixels);
+    }
+
+    /* полосы во всю ширину, если ореол занимает не больше половины полосы, иначе квадраты */
+    int rw = limit / w > (cl_ulong)4 * k ? w : std::min(w, (int)std::sqrt((double)limit));
+    int rh = (int)std::min<cl_ulong>(h, limit / std::max(rw, 1));
+    const int tw = rw == w ? w : rw - 2 * k;
+    const int th = rh == h ? h : rh - 2 * k;
+
+    /* ореол читает только соседний тайл и соседний ряд */
+    if(tw <= 0 || th <= 0 || (tw < w && tw < k) || (th < h && th < k)) {
+        std::stringstream ss;
+        ss << "Too many iterations for out-of-core processing: halo of " << k
+           << " pixels does not fit into a tile of " << limit << " pixels" << std::endl;
+        throw std::runtime_error(ss.str());
+    }
+
+    std::vector<OutOfCoreTile> tiles;
+
+    for(int y0 = 0; y0 < h; y0 += th) {
+        for(int x0 = 0; x0 < w; x0 += tw) {
+            OutOfCoreTile t;
+            t.x0 = x0;
+            t.y0 = y0;
+            t.x1 = std::min(x0 + tw, w);
+            t.y1 = std::min(y0 + th, h);
+            t.rx0 = std::max(t.x0 - k, 0);
+            t.ry0 = std::max(t.y0 - k, 0);
+            t.rx1 = std::min(t.x1 + k, w);
+            t.ry1 = std::min(t.y1 + k, h);
+            tiles.push_back(t);
+        }
+    }
+
+    if(cdata.verbose) {
+        std::cout << "out-of-core: " << tiles.size() << " tiles of " << tw << "x" << th
+                  << " px, halo " << k << " px" << std::endl;
     }
-}
\ No newline at end of file
+
+    uploadLut(pdata);
+    /* размеры тайлов различаются: программа специализируется только таблицей потоков */
+    specialize(nullptr);
+    /* нижние k строк рядов тайлов: полоса ряда r - band[r % 2] */
+    std::vector<uint> band[2];
+    int band_y[2] = { -1, -1 };
+
+    for(auto &b : band) {
+        b.resize((size_t)k * w);
+    }
+
+    /* полоса - на место в изображении (выгрузки завершены, следующий ряд загружен) */
+    auto flushBand = [&](int b) {
+        if(band_y[b] >= 0) {
+            std::copy(band[b].begin(), band[b].end(), idata->bits + (size_t)band_y[b] * w);
+            band_y[b] = -1;
+        }
+    };
+
+    cl::CommandQueue transfer(context, device, cdata.profile ? CL_QUEUE_PROFILING_ENABLE : 0);
+    cl::Buffer sets[PM_TILE_SETS][2];
+    cl::Event uploaded[PM_TILE_SETS], computed[PM_TILE_SETS], downloaded[PM_TILE_SETS];
+    bool used[PM_TILE_SETS] = { false };
+    std::vector<cl::Event> kernels;
+
+    for(auto &set : sets) {
+        for(auto &b : set) {
+            b = cl::Buffer(context, CL_MEM_READ_WRITE, (size_t)rw * rh * sizeof(uint));
+        }
+    }
+
+    /* область тайла с ореолом - из изображения */
+    auto upload = [&](int t) {
+        const OutOfCoreTile &tile = tiles[t];
+        const int s = t % PM_TILE_SETS;
+        const int tile_w = tile.rx1 - tile.rx0;
+        cl::size_t<3> buffer_origin, host_origin, region;
+        host_origin[0] = tile.rx0 * sizeof(uint);
+        host_origin[1] = tile.ry0;
+        region[0] = tile_w * sizeof(uint);
+        region[1] = tile.ry1 - tile.ry0;
+        region[2] = 1;
+        /* набор освобождается после выгрузки предыдущего тайла */
+        std::vector<cl::Event> wait_list;
+
+        if(used[s]) {
+            wait_list.push_back(downloaded[s]);
+        }
+
+        transfer.enqueueWriteBufferRect(sets[s][0], CL_FALSE, buffer_origin, host_origin, region,
+                                        tile_w * sizeof(uint), 0, w * sizeof(uint), 0, idata->bits,
+                                        &wait_list, &uploaded[s]);
+        transfer.flush();
+        used[s] = true;
+    };
+
+    /* итерации над областью, собственные пиксели - в изображение и полосу */
+    auto compute = [&](int t) {
+        const OutOfCoreTile &tile = tiles[t];
+        const int s = t % PM_TILE_SETS;
+        img_data part = { nullptr, (size_t)(tile.rx1 - tile.rx0) * (tile.ry1 - tile.ry0),
+                          tile.rx1 - tile.rx0, tile.ry1 - tile.ry0 };
+        const Variant &v = variant;
+        cl::Kernel kernel = v.kernel;
+        size_t global_x, global_y;
+        prepare(v, &part, global_x, global_y);
+        std::vector<cl::Event> wait_list { uploaded[s] };
+        int src = 0;
+        computed[s] = uploaded[s];
+
+        for(int it = 0; it < k;) {
+            const int n = std::min(v.steps, k - it);
+            kernel.setArg(0, sets[s][src]);
+            kernel.setArg(1, sets[s][src ^ 1]);
+
+            if(v.steps > 1) {
+                kernel.setArg(6, n);
+            }
+
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_x, global_y),
+                                       cl::NDRange(v.local_x, v.local_y), &wait_list, &computed[s]);
+
+            if(cdata.profile) {
+                kernels.push_back(computed[s]);
+            }
+
+            src ^= 1;
+            it += n;
+        }
+
+        queue.flush();
+        /* строки [y0, y1 - banded) - в изображение, [y1 - banded, y1) - в полосу */
+        const int banded = tile.y1 < h ? k : 0;
+        const int b = (tile.y0 / th) % 2;
+        std::vector<cl::Event> done { computed[s] };
+
+        auto download = [&](int y0, int y1, uint *host, int host_y) {
+            cl::size_t<3> buffer_origin, host_origin, region;
+            buffer_origin[0] = (tile.x0 - tile.rx0) * sizeof(uint);
+            buffer_origin[1] = y0 - tile.ry0;
+            host_origin[0] = tile.x0 * sizeof(uint);
+            host_origin[1] = host_y;
+            region[0] = (tile.x1 - tile.x0) * sizeof(uint);
+            region[1] = y1 - y0;
+            region[2] = 1;
+            transfer.enqueueReadBufferRect(sets[s][src], CL_FALSE, buffer_origin, host_origin, region,
+                                           part.w * sizeof(uint), 0, w * sizeof(uint), 0, host,
+                                           &done, &downloaded[s]);
+        };
+
+        if(tile.y1 - banded > tile.y0) {
+            download(tile.y0, tile.y1 - banded, idata->bits, tile.y0);
+        }
+
+        if(banded) {
+            download(tile.y1 - banded, tile.y1, band[b].data(), 0);
+            band_y[b] = tile.y1 - banded;
+        }
+
+        transfer.flush();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    upload(0);
+
+    for(int t = 0; t < (int)tiles.size(); ++t) {
+        /* первый тайл ряда r: ряд r - 1 загружен целиком (очередь передачи
+           упорядочена), полоса ряда r - 2 больше не читается */
+        if(tiles[t].x0 == 0 && tiles[t].y0 >= 2 * th) {
+            uploaded[t % PM_TILE_SETS].wait();
+            flushBand((tiles[t].y0 / th) % 2);
+        }
+
+        if(t + 1 < (int)tiles.size()) {
+            upload(t + 1);
+        }
+
+        compute(t);
+    }
+
+    transfer.finish();
+    queue.finish();
+    flushBand(0);
+    flushBand(1);
+
+    if(cdata.profile) {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+        std::cout << "out-of-core: kernel time = " << std::fixed << std::setprecision(3)
+                  << (eventsTime(kernels) / 1000000.0) << " ms, wall time = " << wall << " ms" << std::endl;
+    }
+
+    return k;
+}
+
+/*!
+ * \brief Итерации над загруженным изображением (bits[0] или images[0])
+ * \param src - буфер с результатом последней итерации
+ * \param events - запуски ядра (при профилировании)
+ * \return кол-во выполненных итераций
+ */
+int PMSession::filter(bool image, const img_data *idata, proc_data *pdata, int &src,
+                      std::vector<cl::Event> &events)
+{
+    const Variant &v = image ? image_variant : variant;
+    cl::Kernel kernel = v.kernel;
+    cl::Memory mem[2];
+
+    if(image) {
+        mem[0] = images[0];
+        mem[1] = images[1];
+    } else {
+        mem[0] = bits[0];
+        mem[1] = bits[1];
+    }
+
+    /* максимальное изменение канала за итерацию */
+    cl_uint change_host = 0;
+    size_t global_x, global_y;
+    prepare(v, idata, global_x, global_y);
+
+    if(cdata.verbose) {
+        if(image) {
+            std::cout << "image2d path: pm_image" << std::endl;
+        }
+
+        if(v.steps > 1) {
+            std::cout << "iterations per launch: " << v.steps << std::endl;
+        }
+
+        std::cout << "global work size: " << global_x << ", " << global_y << std::endl;
+        std::cout << "image size: " << idata->w << ", " << idata->h << std::endl;
+    }
+
+    int it = 0;
+
+    /* итерации ставятся в очередь подряд: буферы не пересекаются,
+       очередь выполняет команды по порядку, синхронизация с хостом
+       нужна только для проверки сходимости */
+    while(it < pdata->iterations) {
+        if(pdata->epsilon > 0.0f) {
+            change_host = 0;
+            queue.enqueueWriteBuffer(change, CL_FALSE, 0, sizeof(cl_uint), &change_host);
+        }
+
+        /* выполнить ядро */
+        const int n = std::min(v.steps, pdata->iterations - it);
+        cl::Event event;
+        kernel.setArg(0, mem[src]);
+        kernel.setArg(1, mem[src ^ 1]);
+
+        if(v.steps > 1) {
+            kernel.setArg(6, n);
+        }
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_x, global_y),
+                                   cl::NDRange(v.local_x, v.local_y), NULL, &event);
+
+        if(cdata.profile) {
+            events.push_back(event);
+        }
+
+        src ^= 1;
+        it += n;
+
+        if(pdata->epsilon > 0.0f) {
+            /* сходимость */
+            queue.enqueueReadBuffer(change, CL_TRUE, 0, sizeof(cl_uint), &change_host);
+
+            if(change_host < pdata->epsilon) {
+                break;
+            }
+        }
+    }
+
+    return it;
+}
+
+/*!
+ * \brief Профилирование: время итераций по событиям запусков ядра
+ * \note буферы bits используются как рабочие, результат должен быть выгружен
+ */
+void PMSession::report(const Variant &v, const img_data *idata, const std::vector<cl::Event> &events, int it)
+{
+    /* получить данные профилирования по времени */
+    double total_time = eventsTime(events);
+
+    /* результат профилирования */
+    std::cout << "parallel execution time in milliseconds = " << std::fixed
+              << std::setprecision(3) << (total_time / 1000000.0) << " ms" << std::endl;
+
+    if(v.steps > 1) {
+        /* выигрыш относительно запуска на каждую итерацию */
+        double single = singleStepTime(idata, it) * it;
+        std::cout << "temporal blocking: " << v.steps << " iterations per launch, "
+                  << "single-iteration launches = " << std::setprecision(3)
+                  << (single / 1000000.0) << " ms, speedup x" << std::setprecision(2)
+                  << (total_time > 0.0 ? single / total_time : 0.0) << std::endl;
+    }
+}
+
+int PMSession::run(img_data *idata, proc_data *pdata)
+{
+    if(!fitsDevice(idata->size)) {
+        return runOutOfCore(idata, pdata);
+    }
+
+    uploadLut(pdata);
+    specialize(idata);
+    const bool image = use_image && imageFits(idata->w, idata->h);
+    upload(idata, image);
+    std::vector<cl::Event> events;
+    int src = 0;
+    const int it = filter(image, idata, pdata, src, events);
+
+    /* выгрузить результат */
+    if(image) {
+        cl::size_t<3> origin, region;
+        region[0] = idata->w;
+        region[1] = idata->h;
+        region[2] = 1;
+        queue.enqueueReadImage(images[src], CL_TRUE, origin, region, 0, 0, idata->bits);
+    } else {
+        queue.enqueueReadBuffer(bits[src], CL_TRUE, 0, idata->size * sizeof(uint), idata->bits);
+    }
+
+    if(cdata.profile) {
+        report(image ? image_variant : variant, idata, events, it);
+    }
+
+    return it;
+}
+
+/*!
+ * \brief Упаковка RGB24 в пиксели 0x00RRGGBB на хосте (как pm_unpack)
+ */
+static void packRGB(const unsigned char *rgb, uint *bits, size_t count)
+{
+    for(size_t i = 0; i < count; ++i, rgb += 3) {
+        bits[i] = ((uint)rgb[0] << 16) | ((uint)rgb[1] << 8) | rgb[2];
+    }
+}
+
+/*!
+ * \brief Распаковка пикселей 0x00RRGGBB в RGB24 на хосте (как pm_pack)
+ */
+static void unpackRGB(const uint *bits, unsigned char *rgb, size_t count)
+{
+    for(size_t i = 0; i < count; ++i, rgb += 3) {
+        rgb[0] = (unsigned char)(bits[i] >> 16);
+        rgb[1] = (unsigned char)(bits[i] >> 8);
+        rgb[2] = (unsigned char)bits[i];
+    }
+}
+
+int PMSession::runRGB(const unsigned char *src, unsigned char *dst, int w, int h, proc_data *pdata)
+{
+    img_data idata = { nullptr, (size_t)w * h, w, h };
+    const size_t bytes = idata.size * 3;
+    const cl_ulong global_size = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+
+    /* буфер байтов и два буфера пикселей не помещаются или индекс пикселя
+       в pm_unpack/pm_pack (int) не адресует изображение - упаковка на хосте */
+    if(!fitsDevice(idata.size) || bytes > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() ||
+       bytes + 2 * idata.size * sizeof(uint) > global_size || idata.size > (size_t)INT_MAX) {
+        std::vector<uint> packed(idata.size);
+        idata.bits = packed.data();
+        packRGB(src, idata.bits, idata.size);
+        const int it = run(&idata, pdata);
+        unpackRGB(idata.bits, dst, idata.size);
+        return it;
+    }
+
+    uploadLut(pdata);
+    specialize(&idata);
+    const bool image = use_image && imageFits(w, h);
+    reserve(idata.size);
+
+    if(rgb_capacity < bytes) {
+        rgb_bytes = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+        rgb_capacity = bytes;
+    }
+
+    /* байты P6 - на устройство, распаковка в bits[0] */
+    cl::Kernel unpack(program, "pm_unpack");
+    cl::Kernel pack(program, "pm_pack");
+    const cl_int count = (cl_int)idata.size;  /* не больше INT_MAX - проверено выше */
+    cl::size_t<3> origin, region;
+    region[0] = w;
+    region[1] = h;
+    region[2] = 1;
+    queue.enqueueWriteBuffer(rgb_bytes, CL_FALSE, 0, bytes, src);
+    unpack.setArg(0, rgb_bytes);
+    unpack.setArg(1, bits[0]);
+    unpack.setArg(2, count);
+    queue.enqueueNDRangeKernel(unpack, cl::NullRange, cl::NDRange(idata.size), cl::NullRange);
+
+    if(image) {
+        reserveImages(w, h);
+        queue.enqueueCopyBufferToImage(bits[0], images[0], 0, origin, region);
+    }
+
+    std::vector<cl::Event> events;
+    int result = 0;
+    const int it = filter(image, &idata, pdata, result, events);
+
+    /* упаковка результата в байты P6 и выгрузка */
+    if(image) {
+        queue.enqueueCopyImageToBuffer(images[result], bits[0], origin, region, 0);
+        result = 0;
+    }
+
+    pack.setArg(0, bits[result]);
+    pack.setArg(1, rgb_bytes);
+    pack.setArg(2, count);
+    queue.enqueueNDRangeKernel(pack, cl::NullRange, cl::NDRange(idata.size), cl::NullRange);
+    queue.enqueueReadBuffer(rgb_bytes, CL_TRUE, 0, bytes, dst);
+
+    if(cdata.profile) {
+        report(image ? image_variant : variant, &idata, events, it);
+    }
+
+    return it;
+}
+
+/*!
+ * \brief Пул закреплённых (pinned) буферов хоста: буферы CL_MEM_ALLOC_HOST_PTR
+ *        отображаются в память хоста один раз и используются повторно
+ */
+class StagingPool
+{
+public:
+    StagingPool(const cl::Context &context, const cl::CommandQueue &queue)
+        : context(context), queue(queue) {}
+    StagingPool(const StagingPool &) = delete;
+    StagingPool &operator=(const StagingPool &) = delete;
+    ~StagingPool()
+    {
+        try
+        {
+            for(auto &item : items) {
+                if(item.ptr) {
+                    queue.enqueueUnmapMemObject(item.buffer, item.ptr);
+                }
+            }
+
+            queue.finish();
+        } catch(cl::Error) {
+        }
+    }
+    /*!
+     * \brief Занять свободный буфер не меньше pixels пикселей
+     * \return индекс буфера в пуле
+     */
+    int acquire(size_t pixels)
+    {
+        for(size_t i = 0; i < items.size(); ++i) {
+            if(!items[i].busy && items[i].capacity >= pixels) {
+                items[i].busy = true;
+                return (int)i;
+            }
+        }
+
+        /* свободный буфер меньшего размера пересоздаётся, иначе - новый */
+        size_t idx = 0;
+
+        while(idx < items.size() && items[idx].busy) {
+            ++idx;
+        }
+
+        if(idx == items.size()) {
+            items.push_back(Item { cl::Buffer(), nullptr, 0, false });
+        } else {
+            queue.enqueueUnmapMemObject(items[idx].buffer, items[idx].ptr);
+            items[idx].ptr = nullptr;
+        }
+
+        Item &item = items[idx];
+        item.buffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, pixels * sizeof(uint));
+        item.ptr = (uint *)queue.enqueueMapBuffer(item.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                                  0, pixels * sizeof(uint));
+        item.capacity = pixels;
+        item.busy = true;
+        return (int)idx;
+    }
+    void release(int idx)
+    {
+        items[idx].busy = false;
+    }
+    uint *data(int idx) const
+    {
+        return items[idx].ptr;
+    }
+private:
+    struct Item {
+        cl::Buffer buffer;
+        uint *ptr;          ///< отображение буфера в память хоста
+        size_t capacity;    ///< размер в пикселях
+        bool busy;
+    };
+    cl::Context context;
+    cl::CommandQueue queue;
+    std::vector<Item> items;
+};
+
+/*!
+ * \brief Изображение в конвейере: буферы устройства и события стадий
+ */
+struct PipelineSlot {
+    cl::Buffer bits[2];         ///< источник и приёмник итерации
+    size_t capacity;            ///< размер bits в пикселях
+    img_data image;             ///< размер изображения (bits не используется)
+    int index;                  ///< порядковый номер изображения, -1 - слот свободен
+    int src;                    ///< буфер bits с результатом
+    int staging_in;             ///< буферы пула для загрузки и выгрузки
+    int staging_out;
+    cl::Event uploaded, computed, downloaded;
+};
+
+#define PM_PIPELINE_DEPTH 3  /* изображений в конвейере: загрузка, вычисление, выгрузка */
+
+int PMSession::pipeline(proc_data *pdata, const std::function<bool(img_data &)> &load,
+                        const std::function<void(int, const img_data &)> &store)
+{
+    uploadLut(pdata);
+    /* вычисления - в очереди сеанса, передачи - в отдельных очередях */
+    const cl_command_queue_properties properties = cdata.profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+    cl::CommandQueue upload_queue(context, device, properties);
+    cl::CommandQueue download_queue(context, device, properties);
+    StagingPool staging(context, upload_queue);
+    PipelineSlot slots[PM_PIPELINE_DEPTH];
+    cl_ulong global_size = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    static const cl_uint zero = 0;
+    std::vector<cl::Event> kernels;
+    int loaded = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for(auto &slot : slots) {
+        slot.capacity = 0;
+        slot.index = -1;
+    }
+
+    if(cdata.verbose) {
+        std::cout << "pipeline depth: " << PM_PIPELINE_DEPTH
+                  << " (upload, compute and download queues)" << std::endl;
+    }
+
+    /* следующее изображение серии - через буфер пула на устройство */
+    auto stage = [&](PipelineSlot &slot) {
+        img_data idata;
+
+        if(!load(idata)) {
+            return false;
+        }
+
+        if(slot.capacity < idata.size) {
+            /* буферы всех слотов одновременно */
+            if(global_size < 2 * PM_PIPELINE_DEPTH * idata.size * sizeof(uint)) {
+                std::stringstream ss;
+                ss << "Image size is too large for the pipeline, max available memory size is "
+                   << global_size << std::endl;
+                throw std::runtime_error(ss.str());
+            }
+
+            for(auto &b : slot.bits) {
+                b = cl::Buffer(context, CL_MEM_READ_WRITE, idata.size * sizeof(uint));
+            }
+
+            slot.capacity = idata.size;
+        }
+
+        slot.image = idata;
+        slot.image.bits = nullptr;
+        slot.index = loaded++;
+        slot.staging_in = staging.acquire(idata.size);
+        memcpy(staging.data(slot.staging_in), idata.bits, idata.size * sizeof(uint));
+        upload_queue.enqueueWriteBuffer(slot.bits[0], CL_FALSE, 0, idata.size * sizeof(uint),
+                                        staging.data(slot.staging_in), NULL, &slot.uploaded);
+        upload_queue.flush();
+        return true;
+    };
+
+    /* итерации после загрузки, выгрузка после итераций */
+    auto compute = [&](PipelineSlot &slot) {
+        specialize(&slot.image);
+        const Variant &v = variant;
+        cl::Kernel kernel = v.kernel;
+        size_t global_x, global_y;
+        prepare(v, &slot.image, global_x, global_y);
+        std::vector<cl::Event> wait_list { slot.uploaded };
+        slot.src = 0;
+        slot.computed = slot.uploaded;
+
+        for(int it = 0; it < pdata->iterations;) {
+            if(pdata->epsilon > 0.0f) {
+                queue.enqueueWriteBuffer(change, CL_FALSE, 0, sizeof(cl_uint), &zero);
+            }
+
+            const int n = std::min(v.steps, pdata->iterations - it);
+            kernel.setArg(0, slot.bits[slot.src]);
+            kernel.setArg(1, slot.bits[slot.src ^ 1]);
+
+            if(v.steps > 1) {
+                kernel.setArg(6, n);
+            }
+
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_x, global_y),
+                                       cl::NDRange(v.local_x, v.local_y), &wait_list, &slot.computed);
+
+            if(cdata.profile) {
+                kernels.push_back(slot.computed);
+            }
+
+            slot.src ^= 1;
+            it += n;
+
+            if(pdata->epsilon > 0.0f) {
+                cl_uint change_host = 0;
+                queue.enqueueReadBuffer(change, CL_TRUE, 0, sizeof(cl_uint), &change_host);
+
+                if(change_host < pdata->epsilon) {
+                    break;
+                }
+            }
+        }
+
+        queue.flush();
+        slot.staging_out = staging.acquire(slot.image.size);
+        std::vector<cl::Event> computed { slot.computed };
+        download_queue.enqueueReadBuffer(slot.bits[slot.src], CL_FALSE, 0, slot.image.size * sizeof(uint),
+                                         staging.data(slot.staging_out), &computed, &slot.downloaded);
+        download_queue.flush();
+    };
+
+    /* результат - из буфера пула, слот освобождается */
+    auto finish = [&](PipelineSlot &slot) {
+        slot.downloaded.wait();
+        img_data result = slot.image;
+        result.bits = staging.data(slot.staging_out);
+        store(slot.index, result);
+        staging.release(slot.staging_in);
+        staging.release(slot.staging_out);
+        slot.index = -1;
+    };
+
+    /* шаг i: выгрузка i - 1 и загрузка i + 1 идут одновременно с вычислением i */
+    bool more = stage(slots[0]);
+    int i = 0;
+
+    while(more) {
+        PipelineSlot &current = slots[i % PM_PIPELINE_DEPTH];
+        PipelineSlot &next = slots[(i + 1) % PM_PIPELINE_DEPTH];
+
+        if(next.index >= 0) {
+            finish(next);
+        }
+
+        more = stage(next);
+        compute(current);
+        ++i;
+    }
+
+    /* оставшиеся результаты - в порядке загрузки */
+    for(int k = 1; k < PM_PIPELINE_DEPTH; ++k) {
+        PipelineSlot &slot = slots[(i + k) % PM_PIPELINE_DEPTH];
+
+        if(slot.index >= 0) {
+            finish(slot);
+        }
+    }
+
+    if(cdata.profile && loaded) {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+        double kernel_time = eventsTime(kernels) / 1000000.0;
+        std::cout << "pipeline: " << loaded << " images, kernel time = " << std::fixed
+                  << std::setprecision(3) << kernel_time << " ms, wall time = " << wall
+                  << " ms (kernel share " << std::setprecision(1)
+                  << (wall > 0.0 ? kernel_time * 100.0 / wall : 0.0) << "%)" << std::endl;
+    }
+
+    return loaded;
+}
+
+/*!
+ * \brief Допустимые варианты для настройки: все ядра программы с группами
+ *        из степеней двойки, кратными CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE
+ *        (до 1024 элементов), pm_temporal - с 2, 4, 8, 16 итерациями за запуск
+ */
+std::vector<PMSession::Variant> PMSession::candidates(const img_data *idata) const
+{
+    std::vector<Variant> result;
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    const std::string names[] = { "pm", "pm_vec", "pm_local", "pm_temporal", "pm_image" };
+
+    for(const std::string &name : names) {
+        if(name == "pm_image" && !imageFits(idata->w, idata->h)) {
+            continue;
+        }
+
+        cl::Kernel k(program, name.c_str());
+        const size_t max_group = std::min<size_t>(k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), 1024);
+        const size_t multiple = k.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+        /* множитель больше допустимой группы не достижим */
+        const size_t min_group = std::max<size_t>(std::min(multiple, max_group), 1);
+
+        for(size_t lx = 1; lx <= max_items[0] && lx <= max_group; lx *= 2) {
+            for(size_t ly = 1; ly <= max_items[1] && lx * ly <= max_group; ly *= 2) {
+                if(lx * ly < min_group || (lx * ly) % min_group) {
+                    continue;
+                }
+
+                Variant v;
+
+                if(name == "pm_temporal") {
+                    for(int steps = 2; steps <= PM_MAX_STEPS; steps *= 2) {
+                        if(makeVariant(name, lx, ly, steps, v)) {
+                            result.push_back(v);
+                        }
+                    }
+                } else if(makeVariant(name, lx, ly, 1, v)) {
+                    result.push_back(v);
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Время варианта в наносекундах на итерацию (по часам хоста,
+ *        с ожиданием очереди); изображение уже загружено
+ * \param iterations - кол-во замеряемых итераций, первый запуск - прогрев
+ */
+double PMSession::variantTime(const Variant &v, const img_data *idata, int iterations)
+{
+    cl::Kernel kernel = v.kernel;
+    cl::Memory mem[2];
+
+    if(v.image) {
+        mem[0] = images[0];
+        mem[1] = images[1];
+    } else {
+        mem[0] = bits[0];
+        mem[1] = bits[1];
+    }
+
+    size_t global_x, global_y;
+    prepare(v, idata, global_x, global_y);
+
+    if(v.steps > 1) {
+        kernel.setArg(6, v.steps);
+    }
+
+    const int launches = std::max(iterations / v.steps, 1);
+    auto start = std::chrono::steady_clock::now();
+
+    for(int i = 0; i <= launches; ++i) {
+        if(i == 1) {
+            queue.finish();
+            start = std::chrono::steady_clock::now();
+        }
+
+        kernel.setArg(0, mem[i & 1]);
+        kernel.setArg(1, mem[(i & 1) ^ 1]);
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_x, global_y),
+                                   cl::NDRange(v.local_x, v.local_y));
+    }
+
+    queue.finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return seconds * 1e9 / ((double)launches * v.steps);
+}
+
+void PMSession::tune(img_data *idata, proc_data *pdata)
+{
+    const int iterations = std::max(pdata->iterations, 1);
+    uploadLut(pdata);
+    specialize(idata);
+    upload(idata, false);
+
+    if(imageFits(idata->w, idata->h)) {
+        upload(idata, true);
+    }
+
+    Variant best;
+    double best_time = -1.0;
+
+    for(const Variant &v : candidates(idata)) {
+        double elapsed;
+
+        try
+        {
+            elapsed = variantTime(v, idata, iterations);
+        } catch(cl::Error) {
+            continue;   /* например, CL_OUT_OF_RESOURCES */
+        }
+
+        if(cdata.verbose) {
+            std::cout << v.kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << " " << v.local_x << "x" << v.local_y
+                      << " steps " << v.steps << ": " << std::fixed << std::setprecision(3)
+                      << (elapsed / 1000000.0) << " ms per iteration" << std::endl;
+        }
+
+        if(best_time < 0.0 || elapsed < best_time) {
+            best = v;
+            best_time = elapsed;
+        }
+    }
+
+    if(best_time < 0.0) {
+        throw std::runtime_error("No kernel variant could be launched!");
+    }
+
+    /* при image2d_t вариант для буферов остаётся для изображений,
+       не помещающихся в image2d_t */
+    if(best.image) {
+        image_variant = best;
+    } else {
+        variant = best;
+    }
+
+    use_image = best.image;
+    builds[build_options] = Build { program, variant, image_variant, use_image };
+    const std::string name = best.kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+
+    if(cdata.verbose) {
+        std::cout << "tuned: " << name << " " << best.local_x << "x" << best.local_y
+                  << " steps " << best.steps << ", " << std::fixed << std::setprecision(3)
+                  << (best_time / 1000000.0) << " ms per iteration" << std::endl;
+    }
+
+    const std::string path = tunePath();
+
+    if(path.empty()) {
+        return;
+    }
+
+    std::string dname;
+    device.getInfo(CL_DEVICE_NAME, &dname);
+    makeDir(cdata.cache_dir);
+    std::stringstream out;
+    out << "# " << dname << std::endl
+        << name << " " << best.local_x << " " << best.local_y << " " << best.steps << std::endl;
+    const std::string data = out.str();
+
+    /* прерванная запись не оставляет усечённый файл */
+    if(!writeFile(path, data.data(), data.size())) {
+        throw std::runtime_error("Failed to write tuning file " + path);
+    }
+
+    if(cdata.verbose) {
+        std::cout << "tuning saved: " << path << std::endl;
+    }
+}
+
+double PMSession::measure(const img_data *idata, proc_data *pdata)
+{
+    uploadLut(pdata);
+    specialize(idata);
+    upload(idata, false);
+    return variantTime(variant, idata, std::max(std::min(pdata->iterations, 4), 1));
+}
+
+void PMSession::begin(const img_data *idata, proc_data *pdata)
+{
+    uploadLut(pdata);
+    specialize(idata);
+    upload(idata, false);
+    prepare(variant, idata, step_global_x, step_global_y);
+    step_w = idata->w;
+    step_src = 0;
+}
+
+int PMSession::stepsPerLaunch() const
+{
+    return variant.steps;
+}
+
+void PMSession::iterate(int n, bool converge)
+{
+    cl::Kernel kernel = variant.kernel;
+    static const cl_uint zero = 0;
+
+    for(int it = 0; it < n;) {
+        const int m = std::min(variant.steps, n - it);
+
+        if(converge) {
+            queue.enqueueWriteBuffer(change, CL_FALSE, 0, sizeof(cl_uint), &zero);
+        }
+
+        kernel.setArg(0, bits[step_src]);
+        kernel.setArg(1, bits[step_src ^ 1]);
+
+        if(variant.steps > 1) {
+            kernel.setArg(6, m);
+        }
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(step_global_x, step_global_y),
+                                   cl::NDRange(variant.local_x, variant.local_y));
+        step_src ^= 1;
+        it += m;
+    }
+
+    /* отправить на устройство, не дожидаясь остальных очередей */
+    queue.flush();
+}
+
+void PMSession::readRows(int y, int rows, uint *dst)
+{
+    queue.enqueueReadBuffer(bits[step_src], CL_FALSE, (size_t)y * step_w * sizeof(uint),
+                            (size_t)rows * step_w * sizeof(uint), dst);
+}
+
+void PMSession::writeRows(int y, int rows, const uint *src)
+{
+    queue.enqueueWriteBuffer(bits[step_src], CL_TRUE, (size_t)y * step_w * sizeof(uint),
+                             (size_t)rows * step_w * sizeof(uint), src);
+}
+
+void PMSession::setRows(int rows)
+{
+    cl::Kernel kernel = variant.kernel;
+    kernel.setArg(5, rows);
+    step_global_y = (rows + variant.local_y - 1) / variant.local_y * variant.local_y;
+}
+
+void PMSession::setChangeRows(int y0, int y1)
+{
+    if(variant.steps > 1) {
+        cl::Kernel kernel = variant.kernel;
+        kernel.setArg(8, y0);
+        kernel.setArg(9, y1);
+    }
+}
+
+void PMSession::wait()
+{
+    queue.finish();
+}
+
+cl_uint PMSession::lastChange()
+{
+    cl_uint value = 0;
+    queue.enqueueReadBuffer(change, CL_TRUE, 0, sizeof(cl_uint), &value);
+    return value;
+}
+
+int pm_parallel(img_data *idata, proc_data *pdata, cl_data *cdata)
+{
+    PMSession session(*cdata);
+    return session.run(idata, pdata);
+}
+
+int pm_parallel_rgb(const unsigned char *src, unsigned char *dst, int w, int h,
+                    proc_data *pdata, cl_data *cdata)
+{
+    PMSession session(*cdata);
+    return session.runRGB(src, dst, w, h, pdata);
+}
+
+/*!
+ * \brief Полоса изображения на устройстве
+ */
+struct DeviceStrip {
+    int y0, y1;             ///< собственные строки [y0, y1)
+    int top, bottom;        ///< строк ореола сверху и снизу
+    std::vector<uint> first; ///< первые строки полосы (ореол предыдущей)
+    std::vector<uint> last;  ///< последние строки полосы (ореол следующей)
+};
+
+int pm_multi(img_data *idata, proc_data *pdata, cl_data *cdata, const std::vector<int> &devices)
+{
+    /* устройства платформы */
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+
+    if(!platforms.size()) {
+        throw std::runtime_error("No OpenCL platforms were found!");
+    }
+
+    cl::Platform platform = cdata->platformId >= 0 && cdata->platformId < platforms.size() ?
+                            platforms[cdata->platformId] : platforms.front();
+    std::vector<cl::Device> all, selected;
+    platform.getDevices(CL_DEVICE_TYPE_ALL, &all);
+
+    if(!all.size()) {
+        throw std::runtime_error("No OpenCL devices were found!");
+    }
+
+    for(int idx : devices) {
+        if(idx < 0 || idx >= all.size()) {
+            throw std::invalid_argument("Invalid device index " + std::to_string(idx));
+        }
+
+        selected.push_back(all[idx]);
+    }
+
+    if(selected.empty()) {
+        selected = all;
+    }
+
+    std::vector<std::unique_ptr<PMSession> > sessions;
+    int k = PM_MAX_STEPS;
+
+    for(auto &device : selected) {
+        sessions.emplace_back(new PMSession(*cdata, device));
+        k = std::min(k, sessions.back()->stepsPerLaunch());
+    }
+
+    /* полоса не меньше глубины ореола */
+    const int count = std::max(std::min((int)sessions.size(), idata->h / k), 1);
+    sessions.resize(count);
+
+    if(count == 1) {
+        return sessions.front()->run(idata, pdata);
+    }
+
+    /* производительность: время итерации на одинаковой выборке строк */
+    const int w = idata->w, h = idata->h;
+    const int sample_h = std::min(h, std::max(64, h / count));
+    img_data sample = { idata->bits, (size_t)w * sample_h, w, sample_h };
+    std::vector<double> speed(count);
+    double total = 0.0;
+
+    for(int i = 0; i < count; ++i) {
+        speed[i] = 1.0 / std::max(sessions[i]->measure(&sample, pdata), 1.0);
+        total += speed[i];
+    }
+
+    /* границы полос пропорционально производительности, не меньше k строк */
+    std::vector<DeviceStrip> strips(count);
+    double share = 0.0;
+
+    for(int i = 0; i < count; ++i) {
+        DeviceStrip &s = strips[i];
+        share += speed[i];
+        s.y0 = i ? strips[i - 1].y1 : 0;
+        s.y1 = i == count - 1 ? h : (int)(h * share / total + 0.5);
+        s.y1 = std::min(std::max(s.y1, s.y0 + k), h - (count - 1 - i) * k);
+        s.top = i ? k : 0;
+        s.bottom = i < count - 1 ? k : 0;
+        s.first.resize((size_t)k * w);
+        s.last.resize((size_t)k * w);
+        img_data part = { idata->bits + (size_t)(s.y0 - s.top) * w,
+                          (size_t)(s.y1 - s.y0 + s.top + s.bottom) * w,
+                          w, s.y1 - s.y0 + s.top + s.bottom };
+        sessions[i]->begin(&part, pdata);
+        /* сходимость - только по собственным строкам, как у одного устройства */
+        sessions[i]->setChangeRows(s.top, s.top + s.y1 - s.y0);
+
+        if(cdata->verbose) {
+            std::string name;
+            sessions[i]->getDevice().getInfo(CL_DEVICE_NAME, &name);
+            std::cout << "strip " << i << ": " << name << ", rows " << s.y0 << "-" << s.y1
+                      << " (" << std::fixed << std::setprecision(1)
+                      << (speed[i] * 100.0 / total) << "% throughput)" << std::endl;
+        }
+    }
+
+    if(cdata->verbose) {
+        std::cout << "halo rows exchanged every " << k << " iterations" << std::endl;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const bool converge = pdata->epsilon > 0.0f;
+    int it = 0;
+
+    while(it < pdata->iterations) {
+        const int n = std::min(k, pdata->iterations - it);
+
+        /* полосы считаются одновременно */
+        for(auto &session : sessions) {
+            session->iterate(n, converge);
+        }
+
+        /* крайние собственные строки полос */
+        for(int i = 0; i < count; ++i) {
+            const DeviceStrip &s = strips[i];
+            const int rows = s.y1 - s.y0;
+
+            if(s.top) {
+                sessions[i]->readRows(s.top, k, strips[i].first.data());
+            }
+
+            if(s.bottom) {
+                sessions[i]->readRows(s.top + rows - k, k, strips[i].last.data());
+            }
+        }
+
+        for(auto &session : sessions) {
+            session->wait();
+        }
+
+        /* ореол - из соседних полос */
+        for(int i = 0; i < count; ++i) {
+            const DeviceStrip &s = strips[i];
+
+            if(s.top) {
+                sessions[i]->writeRows(0, k, strips[i - 1].last.data());
+            }
+
+            if(s.bottom) {
+                sessions[i]->writeRows(s.top + s.y1 - s.y0, k, strips[i + 1].first.data());
+            }
+        }
+
+        it += n;
+
+        if(converge) {
+            cl_uint change = 0;
+
+            for(auto &session : sessions) {
+                change = std::max(change, session->lastChange());
+            }
+
+            if(change < pdata->epsilon) {
+                break;
+            }
+        }
+    }
+
+    /* собственные строки полос на место */
+    for(int i = 0; i < count; ++i) {
+        const DeviceStrip &s = strips[i];
+        sessions[i]->readRows(s.top, s.y1 - s.y0, idata->bits + (size_t)s.y0 * w);
+    }
+
+    for(auto &session : sessions) {
+        session->wait();
+    }
+
+    if(cdata->profile) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "multi-device execution time in milliseconds = " << std::fixed
+                  << std::setprecision(3) << (seconds * 1000.0) << " ms" << std::endl;
+    }
+
+    return it;
+}
@@ -0,0 +1,227 @@
+/*!
+  \file
+  \brief Конвейер итераций фильтра Перона-Малика над потоком строк
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "pm_pipeline.hpp"
+#include "thread_pool.hpp" // ThreadPool
+
+#include <iostream>
+#include <atomic>
+#include <thread>       // yield, hardware_concurrency
+#include <exception>    // exception_ptr
+#include <memory>       // unique_ptr
+#include <algorithm>    // std::min, std::max, std::copy
+#include <vector>
+
+/*!
+ * \brief Строк в кольцевом буфере между соседними стадиями
+ */
+#define PM_RING_ROWS 8
+
+/*!
+ * \brief Кольцевой буфер строк без блокировок: один производитель,
+ *        один потребитель. Индекс записи изменяет только производитель,
+ *        индекс чтения - только потребитель; строка публикуется
+ *        release-записью индекса и забирается после acquire-чтения.
+ */
+class RowRing
+{
+public:
+    RowRing(int w, const std::atomic<bool> &cancel) :
+        slots((size_t)PM_RING_ROWS * w), w(w), cancel(cancel), head(0), tail(0) {}
+    /*!
+     * \brief Записать строку, ожидая свободное место
+     * \return false - конвейер остановлен
+     */
+    bool push(const uint *row)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+
+        while(h - tail.load(std::memory_order_acquire) == PM_RING_ROWS) {
+            if(cancel.load(std::memory_order_relaxed)) return false;
+
+            std::this_thread::yield();
+        }
+
+        std::copy(row, row + w, &slots[(h % PM_RING_ROWS) * w]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    /*!
+     * \brief Прочитать строку, ожидая её появления
+     * \return false - конвейер остановлен
+     */
+    bool pop(uint *row)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+
+        while(head.load(std::memory_order_acquire) == t) {
+            if(cancel.load(std::memory_order_relaxed)) return false;
+
+            std::this_thread::yield();
+        }
+
+        const uint *slot = &slots[(t % PM_RING_ROWS) * w];
+        std::copy(slot, slot + w, row);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+private:
+    std::vector<uint> slots;
+    const int w;
+    const std::atomic<bool> &cancel;
+    /* индексы в разных строках кэша: производитель и потребитель не мешают друг другу */
+    char pad0[64];
+    std::atomic<size_t> head;   ///< строк записано
+    char pad1[64];
+    std::atomic<size_t> tail;   ///< строк прочитано
+    char pad2[64];
+};
+
+/*!
+ * \brief Одна итерация pm() над потоком строк: строка y пересчитывается,
+ *        когда получена строка y+1 предыдущей итерации; хранятся
+ *        пересчитанная строка y-1 и строка y
+ */
+class RowStage
+{
+public:
+    RowStage(int w, int h, const float *lut) : north(w), cur(w), w(w), h(h), lut(lut), received(0) {}
+    /*!
+     * \brief Следующая строка предыдущей итерации; emit - готовые строки по порядку
+     */
+    template<class Emit> void feed(const uint *row, Emit emit)
+    {
+        const int y = received++;
+
+        if(y == 0) {
+            /* граница не пересчитывается */
+            emit(row);
+            std::copy(row, row + w, north.begin());
+            return;
+        }
+
+        if(y > 1) {
+            /* строка y-1: сверху - уже новая, снизу - row */
+            pm_row(north.data(), cur.data(), row, w, lut);
+            emit(cur.data());
+            north.swap(cur);
+        }
+
+        std::copy(row, row + w, cur.begin());
+
+        if(y == h - 1) {
+            emit(cur.data());
+        }
+    }
+private:
+    std::vector<uint> north, cur;
+    const int w, h;
+    const float *lut;
+    int received;
+};
+
+/*!
+ * \brief Блок последовательных итераций одного потока: строки проходят
+ *        по цепочке стадий без очередей, результат - в выходной буфер
+ */
+class StageBlock
+{
+public:
+    StageBlock(int w, int h, const float *lut, int iterations, RowRing *out) : out(out)
+    {
+        stages.reserve(iterations);
+
+        for(int i = 0; i < iterations; ++i) {
+            stages.emplace_back(w, h, lut);
+        }
+    }
+    void feed(size_t i, const uint *row)
+    {
+        if(i == stages.size()) {
+            out->push(row);
+        } else {
+            stages[i].feed(row, [this, i](const uint *r) { feed(i + 1, r); });
+        }
+    }
+private:
+    std::vector<RowStage> stages;
+    RowRing *out;
+};
+
+int pm_pipeline(int w, int h, const row_reader &read, const row_writer &write,
+                proc_data *pdata, int stages, bool verbose)
+{
+    float table[PM_LUT_SIZE];
+    const float *lut = pdata->lut;
+
+    if(!lut) {
+        pm_lut_init(table, pdata);
+        lut = table;
+    }
+
+    const int iterations = std::max(pdata->iterations, 0);
+
+    if(stages <= 0) {
+        /* чтение и запись - свои потоки */
+        stages = std::max((int)std::thread::hardware_concurrency() - 2, 1);
+    }
+
+    stages = std::min(stages, std::max(iterations, 1));
+
+    if(verbose) {
+        std::cout << "row pipeline: " << stages << " stages, about "
+                  << (iterations + stages - 1) / stages << " iterations per stage, "
+                  << PM_RING_ROWS << " rows per queue" << std::endl;
+    }
+
+    std::atomic<bool> cancel(false);
+    /* очередь j - вход стадии j, очередь stages - вход записи */
+    std::vector<std::unique_ptr<RowRing>> rings;
+
+    for(int j = 0; j <= stages; ++j) {
+        rings.emplace_back(new RowRing(w, cancel));
+    }
+
+    std::vector<std::exception_ptr> errors(stages + 2);
+    ThreadPool pool(stages + 2);
+
+    pool.run([&](int idx) {
+        std::vector<uint> row(w);
+
+        try
+        {
+            if(idx == 0) {
+                for(int y = 0; y < h && !cancel; ++y) {
+                    read(row.data());
+                    rings[0]->push(row.data());
+                }
+            } else if(idx == stages + 1) {
+                for(int y = 0; y < h && rings[stages]->pop(row.data()); ++y) {
+                    write(row.data());
+                }
+            } else {
+                /* итерации [i0, i1) стадии idx-1 */
+                const int i0 = (int)((long long)iterations * (idx - 1) / stages);
+                const int i1 = (int)((long long)iterations * idx / stages);
+                StageBlock block(w, h, lut, i1 - i0, rings[idx].get());
+
+                for(int y = 0; y < h && rings[idx - 1]->pop(row.data()); ++y) {
+                    block.feed(0, row.data());
+                }
+            }
+        } catch(...) {
+            errors[idx] = std::current_exception();
+            cancel = true;
+        }
+    });
+
+    for(auto &e : errors) {
+        if(e) std::rethrow_exception(e);
+    }
+
+    return iterations;
+}
@@ -0,0 +1,138 @@
+/*!
+  \file
+  \brief Итерации фильтра Перона-Малика на раздельных float-плоскостях
+         с двойной буферизацией (основа pm_cpu)
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "pm_planar.h"
+
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memcpy */
+
+#define PM_RED(rgb)     (( (rgb) >> 16) & 0xffu)
+#define PM_GREEN(rgb)   (( (rgb) >> 8 ) & 0xffu)
+#define PM_BLUE(rgb)    (  (rgb)        & 0xffu)
+#define PM_RGB(r, g, b) (( (r) & 0xffu) << 16) | (( (g) & 0xffu) << 8) | ( (b) & 0xffu)
+
+int pm_planar_alloc(planar_data *pd, int w, int h)
+{
+    size_t size = (size_t)w * h * PM_PLANES * sizeof(float);
+    pd->buf[0] = (float *)malloc(size);
+    pd->buf[1] = (float *)malloc(size);
+    pd->src = 0;
+    pd->w = w;
+    pd->h = h;
+
+    if(!pd->buf[0] || !pd->buf[1]) {
+        pm_planar_free(pd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void pm_planar_free(planar_data *pd)
+{
+    free(pd->buf[0]);
+    free(pd->buf[1]);
+    pd->buf[0] = pd->buf[1] = NULL;
+}
+
+float *pm_planar_plane(const planar_data *pd, int buf, int ch)
+{
+    return pd->buf[buf] + (size_t)ch * pd->w * pd->h;
+}
+
+void pm_planar_unpack(planar_data *pd, const img_data *idata)
+{
+    size_t size = (size_t)pd->w * pd->h;
+    float *r = pm_planar_plane(pd, 0, 0);
+    float *g = pm_planar_plane(pd, 0, 1);
+    float *b = pm_planar_plane(pd, 0, 2);
+
+    for(size_t i = 0; i < size; ++i) {
+        uint rgb = idata->bits[i];
+        r[i] = (float)PM_RED(rgb);
+        g[i] = (float)PM_GREEN(rgb);
+        b[i] = (float)PM_BLUE(rgb);
+    }
+
+    memcpy(pd->buf[1], pd->buf[0], size * PM_PLANES * sizeof(float));
+    pd->src = 0;
+}
+
+/*!
+ * \brief Округление к ближайшему с ограничением [0, 255]
+ */
+static uint toByte(float v)
+{
+    return v <= 0.0f ? 0u : v >= 255.0f ? 255u : (uint)(v + 0.5f);
+}
+
+void pm_planar_pack(const planar_data *pd, img_data *idata)
+{
+    size_t size = (size_t)pd->w * pd->h;
+    const float *r = pm_planar_plane(pd, pd->src, 0);
+    const float *g = pm_planar_plane(pd, pd->src, 1);
+    const float *b = pm_planar_plane(pd, pd->src, 2);
+
+    for(size_t i = 0; i < size; ++i) {
+        idata->bits[i] = PM_RGB(toByte(r[i]), toByte(g[i]), toByte(b[i]));
+    }
+}
+
+void pm_coef_init(float *coef, const proc_data *pdata)
+{
+    for(int d = 0; d < PM_COEF_SIZE; ++d) {
+        float c = pdata->conduction_func ? pm_exponential(d, pdata->thresh)
+                                         : pm_quadric(d, pdata->thresh);
+        coef[d] = pdata->lambda * c;
+    }
+}
+
+void pm_planar_setup(planar_data *pd, const proc_data *pdata, int isa)
+{
+    pm_coef_init(pd->coef, pdata);
+    pd->row = pm_simd_row(isa);
+}
+
+float pm_planar_rect(planar_data *pd, int x0, int y0, int x1, int y1)
+{
+    const int w = pd->w;
+    float change = 0.0f;
+
+    if(x0 < 1) x0 = 1;
+
+    if(y0 < 1) y0 = 1;
+
+    if(x1 > w - 1) x1 = w - 1;
+
+    if(y1 > pd->h - 1) y1 = pd->h - 1;
+
+    if(x0 >= x1) return change;
+
+    for(int ch = 0; ch < PM_PLANES; ++ch) {
+        const float *src = pm_planar_plane(pd, pd->src, ch);
+        float *dst = pm_planar_plane(pd, pd->src ^ 1, ch);
+
+        for(int y = y0; y < y1; ++y) {
+            const float *c = src + (size_t)y * w;
+            float d = pd->row(c - w, c, c + w, dst + (size_t)y * w, x0, x1, pd->coef);
+            change = d > change ? d : change;
+        }
+    }
+
+    return change;
+}
+
+float pm_planar_rows(planar_data *pd, int y0, int y1)
+{
+    return pm_planar_rect(pd, 1, y0, pd->w - 1, y1);
+}
+
+void pm_planar_swap(planar_data *pd)
+{
+    pd->src ^= 1;
+}
@@ -0,0 +1,302 @@
+/*!
+  \file
+  \brief Векторные (SIMD) реализации строки фильтра Перона-Малика
+         с выбором набора инструкций по CPUID
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "pm_simd.h"
+
+#include <math.h>   /* fabsf */
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define PM_X86
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define PM_TARGET(isa)
+    #else
+        #include <cpuid.h>
+        #define PM_TARGET(isa) __attribute__((target(isa)))
+    #endif
+#endif
+
+/*!
+ * \brief Индекс в таблице lambda*c(|d|): |d|, округлённый к ближайшему
+ * \note векторные реализации повторяют эти операции дословно
+ */
+static int coefIndex(float d)
+{
+    int i = (int)(fabsf(d) + 0.5f);
+    return i < PM_COEF_SIZE - 1 ? i : PM_COEF_SIZE - 1;
+}
+
+float pm_row_scalar(const float *n, const float *c, const float *s,
+                    float *out, int x0, int x1, const float *coef)
+{
+    float change = 0.0f;
+
+    for(int x = x0; x < x1; ++x) {
+        float p = c[x];
+        float dN = n[x] - p;
+        float dS = s[x] - p;
+        float dE = c[x+1] - p;
+        float dW = c[x-1] - p;
+        float fN = coef[coefIndex(dN)] * dN;
+        float fS = coef[coefIndex(dS)] * dS;
+        float fE = coef[coefIndex(dE)] * dE;
+        float fW = coef[coefIndex(dW)] * dW;
+        float v = p + (fN + fS + fE + fW);
+        out[x] = v;
+        change = fmaxf(change, fabsf(v - p));
+    }
+
+    return change;
+}
+
+#ifdef PM_X86
+
+PM_TARGET("sse4.1")
+static float hmaxSSE(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+PM_TARGET("avx2")
+static float hmaxAVX2(__m256 v)
+{
+    return hmaxSSE(_mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+PM_TARGET("avx512f")
+static float hmaxAVX512(__m512 v)
+{
+    return _mm512_reduce_max_ps(v);
+}
+
+PM_TARGET("sse4.1")
+static __m128 coefSSE(__m128 d, const float *coef)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_andnot_ps(sign, d), _mm_set1_ps(0.5f)));
+    i = _mm_min_epi32(i, _mm_set1_epi32(PM_COEF_SIZE - 1));
+    return _mm_setr_ps(coef[_mm_extract_epi32(i, 0)], coef[_mm_extract_epi32(i, 1)],
+                       coef[_mm_extract_epi32(i, 2)], coef[_mm_extract_epi32(i, 3)]);
+}
+
+PM_TARGET("sse4.1")
+static float rowSSE41(const float *n, const float *c, const float *s,
+                      float *out, int x0, int x1, const float *coef)
+{
+    int x = x0;
+    __m128 change = _mm_setzero_ps();
+
+    for(; x + 4 <= x1; x += 4) {
+        __m128 p = _mm_loadu_ps(c + x);
+        __m128 dN = _mm_sub_ps(_mm_loadu_ps(n + x), p);
+        __m128 dS = _mm_sub_ps(_mm_loadu_ps(s + x), p);
+        __m128 dE = _mm_sub_ps(_mm_loadu_ps(c + x + 1), p);
+        __m128 dW = _mm_sub_ps(_mm_loadu_ps(c + x - 1), p);
+        __m128 sum = _mm_add_ps(_mm_mul_ps(coefSSE(dN, coef), dN),
+                                _mm_mul_ps(coefSSE(dS, coef), dS));
+        sum = _mm_add_ps(sum, _mm_mul_ps(coefSSE(dE, coef), dE));
+        sum = _mm_add_ps(sum, _mm_mul_ps(coefSSE(dW, coef), dW));
+        __m128 v = _mm_add_ps(p, sum);
+        _mm_storeu_ps(out + x, v);
+        change = _mm_max_ps(change, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(v, p)));
+    }
+
+    return fmaxf(hmaxSSE(change), pm_row_scalar(n, c, s, out, x, x1, coef));
+}
+
+PM_TARGET("avx2")
+static __m256 coefAVX2(__m256 d, const float *coef)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256i i = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_andnot_ps(sign, d), _mm256_set1_ps(0.5f)));
+    i = _mm256_min_epi32(i, _mm256_set1_epi32(PM_COEF_SIZE - 1));
+    return _mm256_i32gather_ps(coef, i, 4);
+}
+
+PM_TARGET("avx2")
+static float rowAVX2(const float *n, const float *c, const float *s,
+                     float *out, int x0, int x1, const float *coef)
+{
+    int x = x0;
+    __m256 change = _mm256_setzero_ps();
+
+    for(; x + 8 <= x1; x += 8) {
+        __m256 p = _mm256_loadu_ps(c + x);
+        __m256 dN = _mm256_sub_ps(_mm256_loadu_ps(n + x), p);
+        __m256 dS = _mm256_sub_ps(_mm256_loadu_ps(s + x), p);
+        __m256 dE = _mm256_sub_ps(_mm256_loadu_ps(c + x + 1), p);
+        __m256 dW = _mm256_sub_ps(_mm256_loadu_ps(c + x - 1), p);
+        __m256 sum = _mm256_add_ps(_mm256_mul_ps(coefAVX2(dN, coef), dN),
+                                   _mm256_mul_ps(coefAVX2(dS, coef), dS));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(coefAVX2(dE, coef), dE));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(coefAVX2(dW, coef), dW));
+        __m256 v = _mm256_add_ps(p, sum);
+        _mm256_storeu_ps(out + x, v);
+        change = _mm256_max_ps(change, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(v, p)));
+    }
+
+    return fmaxf(hmaxAVX2(change), pm_row_scalar(n, c, s, out, x, x1, coef));
+}
+
+PM_TARGET("avx512f")
+static __m512 coefAVX512(__m512 d, const float *coef)
+{
+    __m512i i = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_abs_ps(d), _mm512_set1_ps(0.5f)));
+    i = _mm512_min_epi32(i, _mm512_set1_epi32(PM_COEF_SIZE - 1));
+    return _mm512_i32gather_ps(i, coef, 4);
+}
+
+PM_TARGET("avx512f")
+static float rowAVX512(const float *n, const float *c, const float *s,
+                       float *out, int x0, int x1, const float *coef)
+{
+    int x = x0;
+    __m512 change = _mm512_setzero_ps();
+
+    for(; x + 16 <= x1; x += 16) {
+        __m512 p = _mm512_loadu_ps(c + x);
+        __m512 dN = _mm512_sub_ps(_mm512_loadu_ps(n + x), p);
+        __m512 dS = _mm512_sub_ps(_mm512_loadu_ps(s + x), p);
+        __m512 dE = _mm512_sub_ps(_mm512_loadu_ps(c + x + 1), p);
+        __m512 dW = _mm512_sub_ps(_mm512_loadu_ps(c + x - 1), p);
+        __m512 sum = _mm512_add_ps(_mm512_mul_ps(coefAVX512(dN, coef), dN),
+                                   _mm512_mul_ps(coefAVX512(dS, coef), dS));
+        sum = _mm512_add_ps(sum, _mm512_mul_ps(coefAVX512(dE, coef), dE));
+        sum = _mm512_add_ps(sum, _mm512_mul_ps(coefAVX512(dW, coef), dW));
+        __m512 v = _mm512_add_ps(p, sum);
+        _mm512_storeu_ps(out + x, v);
+        change = _mm512_max_ps(change, _mm512_abs_ps(_mm512_sub_ps(v, p)));
+    }
+
+    return fmaxf(hmaxAVX512(change), pm_row_scalar(n, c, s, out, x, x1, coef));
+}
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex((int *)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/*!
+ * \brief Регистр XCR0: какие состояния регистров сохраняет ОС
+ */
+static unsigned long long xgetbv0(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static int detectISA(void)
+{
+    unsigned int regs[4] = {0};
+    int isa = PM_ISA_SCALAR;
+    cpuid(0, 0, regs);
+    unsigned int max_leaf = regs[0];
+
+    if(max_leaf < 1) {
+        return isa;
+    }
+
+    cpuid(1, 0, regs);
+
+    if(!(regs[2] & (1u << 19))) {  /* SSE4.1 */
+        return isa;
+    }
+
+    isa = PM_ISA_SSE41;
+
+    /* AVX + OSXSAVE, ОС сохраняет регистры xmm/ymm */
+    if(!(regs[2] & (1u << 28)) || !(regs[2] & (1u << 27)) || max_leaf < 7) {
+        return isa;
+    }
+
+    unsigned long long xcr0 = xgetbv0();
+
+    if((xcr0 & 0x6) != 0x6) {
+        return isa;
+    }
+
+    cpuid(7, 0, regs);
+
+    if(regs[1] & (1u << 5)) {      /* AVX2 */
+        isa = PM_ISA_AVX2;
+
+        /* AVX-512F, ОС сохраняет регистры opmask/zmm */
+        if((regs[1] & (1u << 16)) && (xcr0 & 0xe0) == 0xe0) {
+            isa = PM_ISA_AVX512;
+        }
+    }
+
+    return isa;
+}
+
+#else
+
+static int detectISA(void)
+{
+    return PM_ISA_SCALAR;
+}
+
+#endif  /* PM_X86 */
+
+static int isa_limit = PM_ISA_AVX512;
+
+int pm_simd_detect(void)
+{
+    static int detected = -1;
+
+    if(detected < 0) {
+        detected = detectISA();
+    }
+
+    return detected < isa_limit ? detected : isa_limit;
+}
+
+void pm_simd_limit(int isa)
+{
+    isa_limit = isa < PM_ISA_SCALAR ? PM_ISA_SCALAR : isa;
+}
+
+const char *pm_simd_name(int isa)
+{
+    switch(isa) {
+        case PM_ISA_SSE41:
+            return "sse4.1";
+        case PM_ISA_AVX2:
+            return "avx2";
+        case PM_ISA_AVX512:
+            return "avx512";
+    }
+    return "scalar";
+}
+
+pm_row_func pm_simd_row(int isa)
+{
+#ifdef PM_X86
+    switch(isa) {
+        case PM_ISA_SSE41:
+            return &rowSSE41;
+        case PM_ISA_AVX2:
+            return &rowAVX2;
+        case PM_ISA_AVX512:
+            return &rowAVX512;
+    }
+#endif
+    return &pm_row_scalar;
+}
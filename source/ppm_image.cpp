@@ -11,6 +11,16 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <cstring>      // memcpy
+#include <cstdio>       // snprintf
+#include <cctype>       // isspace, isdigit
+
+#if !defined(_WIN32)
+    #include <sys/mman.h>   // mmap, munmap, madvise
+    #include <sys/stat.h>   // fstat
+    #include <fcntl.h>      // open
+    #include <unistd.h>     // close, ftruncate
+#endif
 
 PPMImage::PPMImage() { }
 PPMImage::~PPMImage() {}
@@ -43,11 +53,14 @@ PPMImage &PPMImage::operator=(const PPMImage &other)
     return *this;
 }
 
-PPMImage PPMImage::load(const std::string &path)
+/*!
+ * \brief Заголовок P6: после чтения поток стоит на байтах пикселей
+ * \throws std::invalid_argument
+ */
+static void readHeader(std::ifstream &in, int &width, int &height)
 {
     std::string header;
-    int width, height, maxColor;
-    std::ifstream in (path, std::ios::binary);
+    int maxColor;
 
     if(in.fail()) {
         throw std::invalid_argument("[ppm]: failed to load");
@@ -83,6 +96,13 @@ PPMImage PPMImage::load(const std::string &path)
     // Пропустить пока не конец строки
     std::string tmp;
     getline(in, tmp);
+}
+
+PPMImage PPMImage::load(const std::string &path)
+{
+    int width, height;
+    std::ifstream in (path, std::ios::binary);
+    readHeader(in, width, height);
     std::vector<char> data(width * height * 3);
     in.read(reinterpret_cast<char *>(data.data()), data.size());
     in.close();
@@ -150,4 +170,238 @@ void PPMImage::unpackData(unsigned int *packed, int size)
 void PPMImage::clear()
 {
     pixel.clear();
-}
\ No newline at end of file
+}
+
+MappedPPM::MappedPPM()
+    : width(0)
+    , height(0)
+    , data(nullptr)
+    , length(0)
+    , payload(0)
+    , fd(-1)
+    , writable(false)
+{ }
+
+MappedPPM::~MappedPPM()
+{
+    close();
+}
+
+/*!
+ * \brief Пропустить пробелы и комментарии заголовка
+ */
+static size_t skipSpace(const char *p, size_t n, size_t i)
+{
+    while(i < n) {
+        if(p[i] == '#') {
+            while(i < n && p[i] != '\n') {
+                ++i;
+            }
+        } else if(isspace((unsigned char)p[i])) {
+            ++i;
+        } else {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*!
+ * \brief Десятичное число заголовка
+ * \return позиция после числа
+ */
+static size_t readNumber(const char *p, size_t n, size_t i, int &value)
+{
+    const size_t start = i;
+    value = 0;
+
+    while(i < n && isdigit((unsigned char)p[i])) {
+        value = value * 10 + (p[i] - '0');
+        ++i;
+    }
+
+    if(i == start) {
+        throw std::invalid_argument("[ppm]: wrong format");
+    }
+
+    return i;
+}
+
+void MappedPPM::open(const std::string &path)
+{
+    close();
+#if defined(_WIN32)
+    PPMImage img = PPMImage::load(path);
+    buffer.swap(img.pixel);
+    width = img.width;
+    height = img.height;
+    data = buffer.data();
+    length = buffer.size();
+    payload = 0;
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+
+    if(fd < 0 || fstat(fd, &st) || st.st_size < 2) {
+        close();
+        throw std::invalid_argument("[ppm]: failed to load");
+    }
+
+    length = st.st_size;
+    void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(p == MAP_FAILED) {
+        close();
+        throw std::invalid_argument("[ppm]: failed to load");
+    }
+
+    data = (char *)p;
+    /* файл читается один раз подряд: упреждающая подкачка страниц */
+    madvise(p, length, MADV_SEQUENTIAL);
+
+    try
+    {
+        int maxColor;
+
+        if(data[0] != 'P' || data[1] != '6') {
+            throw std::invalid_argument("[ppm]: wrong format");
+        }
+
+        size_t i = readNumber(data, length, skipSpace(data, length, 2), width);
+        i = readNumber(data, length, skipSpace(data, length, i), height);
+        i = readNumber(data, length, skipSpace(data, length, i), maxColor);
+
+        if(maxColor != 255) {
+            throw std::invalid_argument("[ppm]: wrong format");
+        }
+
+        /* один пробельный символ после заголовка */
+        payload = i + 1;
+
+        if(payload > length || length - payload < (size_t)width * height * 3) {
+            throw std::invalid_argument("[ppm]: truncated file");
+        }
+    } catch(...) {
+        close();
+        throw;
+    }
+#endif
+}
+
+void MappedPPM::create(const std::string &path, int w, int h)
+{
+    close();
+    char header[64];
+    const int header_length = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h);
+    width = w;
+    height = h;
+    payload = header_length;
+    length = payload + (size_t)w * h * 3;
+#if defined(_WIN32)
+    buffer.resize(length);
+    data = buffer.data();
+    this->path = path;
+#else
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0 || ftruncate(fd, length)) {
+        close();
+        throw std::invalid_argument("[ppm]: failed to save");
+    }
+
+    void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(p == MAP_FAILED) {
+        close();
+        throw std::invalid_argument("[ppm]: failed to save");
+    }
+
+    data = (char *)p;
+#endif
+    memcpy(data, header, header_length);
+    writable = true;
+}
+
+void MappedPPM::close()
+{
+#if defined(_WIN32)
+    if(writable && data) {
+        std::ofstream out(path, std::ios::binary);
+        out.write(data, length);
+    }
+
+    buffer.clear();
+#else
+    if(data) {
+        munmap(data, length);
+    }
+
+    if(fd >= 0) {
+        ::close(fd);
+    }
+#endif
+    data = nullptr;
+    length = 0;
+    payload = 0;
+    fd = -1;
+    writable = false;
+}
+
+const unsigned char *MappedPPM::pixels() const
+{
+    return (const unsigned char *)data + payload;
+}
+
+unsigned char *MappedPPM::writablePixels()
+{
+    if(!writable) {
+        throw std::invalid_argument("[ppm]: mapping is read-only");
+    }
+
+    return (unsigned char *)data + payload;
+}
+
+void PPMReader::open(const std::string &path)
+{
+    in.open(path, std::ios::binary);
+    readHeader(in, width, height);
+}
+
+void PPMReader::readRows(unsigned char *dst, int rows)
+{
+    in.read(reinterpret_cast<char *>(dst), (std::streamsize)rows * width * 3);
+
+    if(in.gcount() != (std::streamsize)rows * width * 3) {
+        throw std::invalid_argument("[ppm]: truncated file");
+    }
+}
+
+void PPMWriter::create(const std::string &path, int w, int h)
+{
+    out.open(path, std::ios::binary);
+
+    if(out.fail()) {
+        throw std::invalid_argument("[ppm]: failed to save");
+    }
+
+    width = w;
+    height = h;
+    out << "P6\n";
+    out << width << " " << height << "\n";
+    out << "255\n";
+}
+
+void PPMWriter::writeRows(const unsigned char *src, int rows)
+{
+    out.write(reinterpret_cast<const char *>(src), (std::streamsize)rows * width * 3);
+
+    if(out.fail()) {
+        throw std::invalid_argument("[ppm]: failed to save");
+    }
+}
+
+void PPMWriter::close()
+{
+    out.close();
+}
@@ -0,0 +1,106 @@
+/*!
+  \file
+  \brief Пул потоков с барьерной синхронизацией
+  \author Ilya Shoshin (Galarius)
+  \copyright (c) 2016, Research Institute of Instrument Engineering
+*/
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(int threads)
+    : task(nullptr)
+    , generation(0)
+    , pending(0)
+    , barrier_count(0)
+    , barrier_generation(0)
+    , stop(false)
+{
+    if(threads <= 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+
+    if(threads <= 0) {
+        threads = 1;
+    }
+
+    /* поток 0 - вызывающий */
+    for(int i = 1; i < threads; ++i) {
+        this->threads.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    start_cv.notify_all();
+
+    for(auto &t : threads) {
+        t.join();
+    }
+}
+
+int ThreadPool::size() const
+{
+    return (int)threads.size() + 1;
+}
+
+void ThreadPool::run(const std::function<void(int)> &task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        pending = (int)threads.size();
+        ++generation;
+    }
+    start_cv.notify_all();
+    task(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return pending == 0; });
+    this->task = nullptr;
+}
+
+void ThreadPool::barrier()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    unsigned long current = barrier_generation;
+
+    if(++barrier_count == size()) {
+        barrier_count = 0;
+        ++barrier_generation;
+        lock.unlock();
+        barrier_cv.notify_all();
+    } else {
+        barrier_cv.wait(lock, [this, current] { return barrier_generation != current; });
+    }
+}
+
+void ThreadPool::worker(int idx)
+{
+    unsigned long seen = 0;
+
+    while(true) {
+        const std::function<void(int)> *current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [this, seen] { return stop || generation != seen; });
+
+            if(stop) {
+                return;
+            }
+
+            seen = generation;
+            current = task;
+        }
+        (*current)(idx);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if(--pending == 0) {
+                done_cv.notify_one();
+            }
+        }
+    }
+}